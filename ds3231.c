@@ -1,15 +1,48 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/cdev.h>
 #include <linux/i2c.h>
+#include <linux/of.h>
+#include <linux/acpi.h>
 #include <linux/bcd.h>
 #include <linux/rtc.h>
 #include <linux/interrupt.h>
+#include <linux/poll.h>
+#include <linux/gpio.h>
+#include <linux/pps_kernel.h>
 #include <linux/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/sched/signal.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/moduleparam.h>
+#include <linux/random.h>
+#include <linux/delay.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/timekeeping.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
 #include <asm/errno.h>
 #include <asm/delay.h>
 
+#define CREATE_TRACE_POINTS
+#include "ds3231_trace.h"
+#include "ds3231_ioctl.h"
+
 
 /* Register Definitionen */
 #define DS3231_REG_SECONDS      0x00
@@ -22,490 +55,3272 @@
 #define DS3231_REG_MONTH        0x05
 # define DS3231_BIT_CENTURY     0x80
 #define DS3231_REG_YEAR         0x06
+#define DS3231_REG_ALARM1       0x07
 #define DS3231_REG_CONTROL      0x0e
 # define DS3231_BIT_nEOSC       0x80
+# define DS3231_BIT_RS2         0x10
+# define DS3231_BIT_RS1         0x08
 # define DS3231_BIT_INTCN       0x04
 # define DS3231_BIT_A2IE        0x02
 # define DS3231_BIT_A1IE        0x01
 #define DS3231_REG_STATUS       0x0f
 # define DS3231_BIT_OSF         0x80
+# define DS3231_BIT_A1F         0x01
+
+/* Länge von "YYYY-MM-DD HH:MM:SS" für write() auf /dev/ds3231 */
+#define DS3231_DATE_STR_LEN     19
+
+/* Maximale Anzahl Bytes pro Burst-Zugriff (Register 0x00 - 0x12) */
+#define DS3231_BURST_MAX        19
 
 
 
 /*
- * Der Zeiger wird bei Initialisierung gesetzt und wird für die
- * i2c Kommunikation mit dem  Device (DS3231) benötigt.
+ * Schatten der Konfigurationsbits, die der Treiber selbst verwaltet.
+ * Wird bei jedem Schreibzugriff aktualisiert, so dass ds3231_write_date()
+ * die Register vorher nicht lesen muss. Zugriff nur unter ds->lock.
  */
-static struct i2c_client *ds3231_client;
+struct ds3231_shadow {
+    bool valid;        /* hour_mode ist gültig */
+    u8 hour_mode;      /* DS3231_BIT_12H oder 0 */
+    u8 control;        /* Register 0x0e */
+    u8 status;         /* Register 0x0f */
+};
 
 
 /*
- * Mutex für den I2C-Zugriff.
+ * Optionaler Zeit-Cache. Nach einem Hardware-Lesezugriff werden weitere
+ * Lesezugriffe für cache_ms Millisekunden ohne Buszugriff aus der Basiszeit
+ * plus vergangener CLOCK_MONOTONIC_RAW-Zeit beantwortet. 0 schaltet den
+ * Cache ab.
+ *
+ * Leser greifen lockfrei über ds->cache_lock (Seqlock) zu, nur wer den
+ * Cache neu befüllt oder invalidiert hält zusätzlich ds->lock.
  */
-static DEFINE_MUTEX(i2c_lock);
+static unsigned int cache_ms;
+module_param(cache_ms, uint, 0644);
+MODULE_PARM_DESC(cache_ms, "Resync-Intervall des Zeit-Caches in ms (0 = Cache aus)");
+
+struct ds3231_cache {
+    bool valid;
+    time64_t base;     /* RTC-Zeit beim letzten Hardware-Lesen */
+    ktime_t stamp;     /* CLOCK_MONOTONIC_RAW zum selben Zeitpunkt */
+};
 
 
-/* --------------------------------------------------------------------------------------------------------
-    Zugriff auf Register des DS3231 und Hilfsfunktionen zur Datumsformatierung
-   --------------------------------------------------------------------------------------------------------*/
+/*
+ * Zusammenfassen gleichzeitiger Hardware-Lesezugriffe ("single flight").
+ * Wer ankommt, während ein Lesezugriff läuft, wartet auf dessen Ergebnis.
+ */
+struct ds3231_flight {
+    bool busy;             /* Hardware-Lesezugriff läuft */
+    unsigned long seq;     /* Anzahl abgeschlossener Lesezugriffe */
+    s32 ret;               /* Ergebnis des letzten Lesezugriffs */
+    struct rtc_time date;
+};
 
 
 /*
- * Liest mehrere Bytes aus dem Register
+ * Optionale Hintergrund-Aktualisierung. Ist refresh_ms gesetzt, liest ein
+ * Worker den DS3231 kurz nach jedem Sekundenwechsel (frühestens nach
+ * refresh_ms) und veröffentlicht das Ergebnis im Zeit-Cache, so dass
+ * Leser im Normalfall nicht auf den Bus warten. Zugriff nur unter ds->lock.
  */
-static s32 ds3231_read_block_data(u8 reg, u8 len, u8 *buf)
-{
-    s32 i, data;
+static unsigned int refresh_ms;
+
+struct ds3231_refresh {
+    bool active;       /* Device ist initialisiert, Worker darf laufen */
+    bool aligned;      /* Lage des Sekundenwechsels ist bekannt */
+    bool have_prev;    /* prev enthält eine gültige Probe */
+    time64_t prev;     /* RTC-Zeit der letzten Probe (Suche) */
+    unsigned int polls; /* Proben der laufenden Suche */
+    time64_t edge_sec; /* RTC-Zeit direkt nach dem Sekundenwechsel */
+    ktime_t edge;      /* CLOCK_MONOTONIC_RAW dieses Sekundenwechsels */
+};
 
-    for(i = 0; i < len; i++) {
-        data = i2c_smbus_read_byte_data(ds3231_client, reg + i);
-        if(data < 0) {
-            printk("DS3231_drv: Kann Register 0x%02x nicht lesen (errorn = %d).\n", reg + i, data);
-            return data;
-        }
-        buf[i] = (u8)data;
-    }
-    return i;
-}
+/* Abtastintervall während der Suche nach dem Sekundenwechsel */
+#define DS3231_ALIGN_POLL_MS    10
+/* Proben pro Suche, deckt gut eine Sekunde ab */
+#define DS3231_ALIGN_MAX_POLLS  (MSEC_PER_SEC / DS3231_ALIGN_POLL_MS + 1)
+/* Abstand der Probe hinter dem erwarteten Sekundenwechsel */
+#define DS3231_ALIGN_MARGIN_MS  2
 
 
 /*
- * Schreibt mehrere Bytes in das Register
+ * Optionale Kalibrierung der Sekundenphase. Der DS3231 hat kein
+ * Subsekunden-Register, deshalb sucht ein Worker alle calib_s Sekunden
+ * den Sekundenwechsel per Intervallhalbierung (höchstens
+ * DS3231_CALIB_PROBES Buszugriffe) und merkt sich dessen Lage. Damit
+ * schalten Cache-Treffer genau am Sekundenwechsel der RTC weiter statt
+ * eine Sekunde nach dem letzten Hardware-Lesen. 0 schaltet die
+ * Kalibrierung ab.
+ *
+ * Aus zwei Sekundenwechseln im Abstand von mindestens DS3231_DRIFT_MIN_S
+ * ergibt sich die Länge einer RTC-Sekunde in CLOCK_MONOTONIC_RAW (period).
+ * Cache und Hintergrund-Aktualisierung rechnen mit ihr statt mit
+ * NSEC_PER_SEC, so dass die Drift zwischen beiden Oszillatoren bis zur
+ * nächsten Kalibrierung nicht aufläuft.
+ *
+ * Leser greifen wie beim Cache lockfrei über ds->cache_lock zu, nur wer
+ * die Phase ändert hält zusätzlich ds->lock.
  */
-static s32 ds3231_write_block_data(u8 reg, u8 len, u8 *buf)
-{
-    s32 i, err;
+static unsigned int calib_s;
+
+struct ds3231_phase {
+    bool valid;
+    time64_t edge_sec;   /* RTC-Zeit direkt nach dem Sekundenwechsel */
+    ktime_t edge;        /* CLOCK_MONOTONIC_RAW dieses Sekundenwechsels */
+    s64 uncertainty;     /* Halbe Breite des Suchintervalls in ns */
+    unsigned int probes; /* Buszugriffe der letzten Kalibrierung */
+    s64 period;          /* Länge einer RTC-Sekunde in CLOCK_MONOTONIC_RAW-ns */
+    bool period_valid;   /* period gemessen, sonst NSEC_PER_SEC */
+    bool ref_valid;      /* Bezug für die Driftmessung vorhanden */
+    time64_t ref_sec;    /* Bezug: RTC-Zeit eines früheren Sekundenwechsels */
+    ktime_t ref_edge;    /* Bezug: dessen CLOCK_MONOTONIC_RAW */
+};
 
-    for(i = 0; i < len; i++) {
-        err = i2c_smbus_write_byte_data(ds3231_client, reg + i, buf[i]);
-        if(err < 0) {
-            printk("DS3231_drv: Kann Register 0x%02x nicht beschreiben (errorn = %d).\n", reg + i, err);
-            return err;
-        }
-    }
-    return 0;
-}
+/* Mindestabstand zweier Sekundenwechsel für eine Driftmessung */
+#define DS3231_DRIFT_MIN_S      30
+/* Größere Abweichungen als 500 ppm gelten als Messfehler */
+#define DS3231_DRIFT_MAX_NS     (500 * NSEC_PER_USEC)
+
+/* Höchstzahl Buszugriffe pro Kalibrierung */
+#define DS3231_CALIB_PROBES     12
+/* Suche beenden, sobald das Intervall so schmal ist */
+#define DS3231_CALIB_RES_US     500
+/* Phase gilt höchstens so viele Kalibrierperioden */
+#define DS3231_CALIB_MAX_AGE    4
+
+/* Mindestvorlauf beim Stellen auf den Sekundenwechsel */
+#define DS3231_SET_GUARD_US     1000
+/* Längste plausible Wartezeit, sonst wurde die Systemzeit zurückgestellt */
+#define DS3231_SET_MAX_WAIT_NS  (2 * NSEC_PER_SEC)
 
 
 /*
- * Datum aus dem Register auslesen und in Struct zurueckgeben
+ * Wiederholungsstrategie für Buszugriffe und Circuit Breaker. Nach
+ * breaker_threshold Fehlern in Folge wird der Bus für breaker_cooldown_ms
+ * nicht mehr angesprochen, Lesezugriffe werden dann aus der letzten
+ * gültigen Zeit bedient und als veraltet markiert.
  */
-static s32 ds3231_read_date(struct rtc_time *date) 
-{
-    s32 ret;
-    u8 regs[7];
-    u8 hour_pm = 0;
+static unsigned int retries = 3;
+module_param(retries, uint, 0644);
+MODULE_PARM_DESC(retries, "Maximale Anzahl Versuche pro Buszugriff");
 
-    mutex_lock(&i2c_lock);
-    ret = ds3231_read_block_data(DS3231_REG_SECONDS, sizeof(regs), regs);
-    mutex_unlock(&i2c_lock);
-    if(ret < 0) {
-        return ret;
-    }
+static unsigned int retry_deadline_ms = 20;
+module_param(retry_deadline_ms, uint, 0644);
+MODULE_PARM_DESC(retry_deadline_ms, "Zeitbudget pro Buszugriff inkl. Wiederholungen in ms");
 
-    /* Registerwerte verwerten */
-    /* ---Date--- */
-    date->tm_mday = bcd2bin(regs[DS3231_REG_DATE]);
+static unsigned int retry_backoff_us = 500;
+module_param(retry_backoff_us, uint, 0644);
+MODULE_PARM_DESC(retry_backoff_us, "Basis des exponentiellen Backoffs in us");
 
-    /* ---Month--- */
-    if(regs[DS3231_REG_MONTH] & DS3231_BIT_CENTURY) {
-        printk("DS3231_drv: Century-Bit ist gesetzt");
-        return EINVAL;
-    }
-    date->tm_mon = bcd2bin(regs[DS3231_REG_MONTH]) - 1;
+static unsigned int breaker_threshold = 5;
+module_param(breaker_threshold, uint, 0644);
+MODULE_PARM_DESC(breaker_threshold, "Fehler in Folge bis zum Aussetzen der Buszugriffe (0 = aus)");
 
-    /* ---Year--- */
-    date->tm_year = bcd2bin(regs[DS3231_REG_YEAR]) + 100;
+static unsigned int breaker_cooldown_ms = 1000;
+module_param(breaker_cooldown_ms, uint, 0644);
+MODULE_PARM_DESC(breaker_cooldown_ms, "Dauer des Aussetzens der Buszugriffe in ms");
 
-    /* ---Hour--- */
-    /*
-     * 24H Format
-     */
-     if(regs[DS3231_REG_HOURS] & DS3231_BIT_12H) {
-        regs[DS3231_REG_HOURS] &= ~DS3231_BIT_12H;
-        if(regs[DS3231_REG_HOURS] & DS3231_BIT_nAM) {
-            hour_pm = 12;
-            regs[DS3231_REG_HOURS] &= ~DS3231_BIT_nAM;
-        }
-    }
-    date->tm_hour = bcd2bin(regs[DS3231_REG_HOURS]) + hour_pm;
+struct ds3231_breaker {
+    unsigned int failures;     /* Fehlgeschlagene Zugriffe in Folge */
+    ktime_t open_until;        /* Bis hierhin keine Buszugriffe */
+};
 
-    /* ---Minute--- */
-    date->tm_min = bcd2bin(regs[DS3231_REG_MINUTES]);
+struct ds3231_last_good {
+    bool valid;
+    bool stale;        /* Letzter Lesezugriff kam aus der Rückfallebene */
+    time64_t base;     /* RTC-Zeit der letzten erfolgreichen Probe */
+    ktime_t stamp;     /* CLOCK_MONOTONIC_RAW zum selben Zeitpunkt */
+};
 
-    /* --- Seconds --- */
-    date->tm_sec = bcd2bin(regs[DS3231_REG_SECONDS]);
+/* Zähler, im sysfs sichtbar */
+struct ds3231_retry_stats {
+    atomic_t retries;          /* Wiederholte Versuche */
+    atomic_t failures;         /* Endgültig fehlgeschlagene Zugriffe */
+    atomic_t breaker_trips;    /* Öffnen des Circuit Breakers */
+    atomic_t short_circuits;   /* Wegen offenem Breaker abgewiesene Zugriffe */
+    atomic_t stale_reads;      /* Aus der letzten gültigen Zeit bediente Lesezugriffe */
+};
 
-    return 0;
+
+/*
+ * Statistiken, im debugfs sichtbar. Die Zähler liegen pro CPU, damit das
+ * Zählen im schnellen Pfad keine gemeinsame Cacheline berührt. Die
+ * Histogramme haben log2-Buckets über Nanosekunden (Bucket i zählt
+ * Werte aus [2^i, 2^(i+1))).
+ */
+enum ds3231_stat_op {
+    DS3231_OP_READ,        /* read() auf /dev/ds3231 */
+    DS3231_OP_WRITE,       /* write() auf /dev/ds3231 */
+    DS3231_OP_RD_TIME,     /* ioctl RTC_RD_TIME bzw. read_time der RTC-Klasse */
+    DS3231_OP_SET_TIME,    /* ioctl RTC_SET_TIME bzw. set_time der RTC-Klasse */
+    DS3231_OP_SET_TIME_TS, /* ioctl DS3231_SET_TIME_TS */
+    DS3231_OP_SYS_OFFSET,  /* ioctl DS3231_SYS_OFFSET */
+    DS3231_OP_PROBE,       /* Registerzugriffe in ds3231_probe() */
+    DS3231_OP_MAX
+};
+
+#define DS3231_HIST_BUCKETS     32
+/* Fehler nach errno, der letzte Eintrag sammelt alle größeren Werte */
+#define DS3231_ERRNO_MAX        136
+
+/*
+ * Die Zeitmessungen für die Histogramme kosten zwei ktime_get() pro
+ * Lock bzw. Busversuch und laufen deshalb nur, solange
+ * /sys/kernel/debug/ds3231/timing auf 1 steht (oder das passende
+ * Trace-Event aktiv ist). Die Zähler laufen immer.
+ */
+static DEFINE_STATIC_KEY_FALSE(ds3231_timing);
+
+struct ds3231_stats {
+    u64 ops[DS3231_OP_MAX];
+    u64 bus_hist[DS3231_HIST_BUCKETS];     /* Dauer eines Busversuchs */
+    u64 lock_hist[DS3231_HIST_BUCKETS];    /* Wartezeit auf ds->lock */
+    u64 errors[DS3231_ERRNO_MAX];          /* Fehlgeschlagene Busversuche */
+};
+
+
+/*
+ * Zustand eines DS3231. Wird in ds3231_probe() angelegt und per
+ * i2c_set_clientdata() an den I2C Client gehängt, so dass mehrere Chips
+ * (z.B. an verschiedenen Adaptern) unabhängig voneinander betrieben
+ * werden können. Jeder Chip hat seinen eigenen Buslock und eine eigene
+ * Minor-Nummer.
+ *
+ * Geöffnete Device-Dateien halten eine Referenz (kref), der Zustand wird
+ * erst mit der letzten freigegeben und kann ds3231_remove() überleben.
+ * Danach ist removed gesetzt und alle Dateioperationen liefern -ENODEV.
+ */
+struct ds3231 {
+    struct kref kref;
+    bool removed;                      /* Client entfernt, unter lock geschrieben */
+    struct i2c_client *client;
+    const struct ds3231_bus_ops *bus;  /* Ausgewähltes Transport-Backend */
+    struct mutex lock;                 /* Serialisiert den Buszugriff */
+
+    struct ds3231_shadow shadow;
+
+    struct ds3231_cache cache;
+    seqlock_t cache_lock;
+
+    struct ds3231_flight flight;
+    spinlock_t flight_lock;
+    wait_queue_head_t flight_wq;
+
+    struct ds3231_refresh refresh;
+    struct delayed_work refresh_work;
+    struct ds3231_phase phase;         /* Unter cache_lock, geschrieben unter lock */
+    atomic_t phase_misses;             /* Cache-Treffer, bei denen die Phase nicht zur Basis passte */
+    struct delayed_work calib_work;
+    unsigned long set_seq;             /* Anzahl Stellvorgänge, unter lock */
+
+    struct work_struct init_work;      /* Hardware-Initialisierung, siehe ds3231_init_fn() */
+    struct completion ready;           /* Initialisierung abgeschlossen */
+    int init_ret;                      /* Ergebnis der Initialisierung */
+
+    struct ds3231_breaker breaker;
+    struct ds3231_last_good last_good;
+    struct ds3231_retry_stats retry_stats;
+    struct ds3231_stats __percpu *stats;
+
+    int id;                            /* Minor-Nummer, 0 = /dev/ds3231 */
+    struct cdev *cdev;                 /* Eigene Allokation, lebt bis zum letzten cdev_put() */
+    struct device *dev;                /* /dev/ds3231 bzw. /dev/ds3231-<id>, NULL ohne legacy_dev */
+    struct rtc_device *rtc;            /* /dev/rtcN */
+    struct dentry *debugfs;
+    struct list_head node;             /* Eintrag in ds3231_devices */
+
+    int irq;                           /* SQW/INT, 0 = nicht verdrahtet */
+    int sqw_gpio;                      /* Angeforderte GPIO für SQW/INT, -1 = keine */
+    bool sqw;                          /* 1-Hz-Ausgang aktiv, unter lock geschrieben */
+    unsigned int uie_users;            /* Anforderungen von Update-Interrupts, unter lock (ds3231_irq liest ohne) */
+    bool pps_hold;                     /* PPS-Quelle hält den 1-Hz-Ausgang, unter lock */
+    unsigned long uie_seq;             /* Anzahl 1-Hz-Flanken, unter uie_lock */
+    ktime_t uie_stamp;                 /* CLOCK_MONOTONIC_RAW der letzten Flanke, unter uie_lock */
+    spinlock_t uie_lock;
+    wait_queue_head_t uie_wq;          /* Wartende Leser */
+    struct pps_device *pps;            /* PPS-Quelle, NULL ohne pps=1 */
+
+    s64 set_error;                     /* Abweichung des letzten Stellens in ns, unter lock */
+    s64 set_uncertainty;               /* Halbe Dauer des Schreibzugriffs in ns, unter lock */
+};
+
+
+/*
+ * Zustand einer geöffneten Device-Datei, liegt in file->private_data.
+ */
+struct ds3231_file {
+    struct ds3231 *ds;
+    bool uie;                  /* Update-Interrupts für diese Datei eingeschaltet, unter ds->lock */
+    unsigned long uie_seq;     /* Zuletzt gelieferte Flanke */
+    u32 mode;                  /* Ausgabeformat von read(), enum ds3231_read_mode */
+};
+
+
+/*
+ * Alle gebundenen Devices, damit Änderungen von Modulparametern alle
+ * Chips erreichen.
+ */
+static LIST_HEAD(ds3231_devices);
+static DEFINE_MUTEX(ds3231_devices_lock);
+
+/* Maximale Anzahl gleichzeitig betriebener DS3231 (Minor-Nummern) */
+#define DS3231_MAX_DEVICES      8
+
+/* Device zu jeder Minor-Nummer von /dev/ds3231, unter ds3231_devices_lock */
+static struct ds3231 *ds3231_minors[DS3231_MAX_DEVICES];
+
+
+/*
+ * Letzte Referenz auf den Zustand eines DS3231 ist weg.
+ */
+static void ds3231_release(struct kref *kref)
+{
+    struct ds3231 *ds = container_of(kref, struct ds3231, kref);
+
+    free_percpu(ds->stats);
+    kfree(ds);
 }
 
 
+/* --------------------------------------------------------------------------------------------------------
+    Transport-Backends für den Registerzugriff
+   --------------------------------------------------------------------------------------------------------*/
+
+
 /*
- * Datum in das Register schreiben
+ * Operationen eines Transport-Backends. Das schnellste vom Adapter
+ * unterstützte Backend wird in ds3231_probe() ausgewählt und bleibt
+ * für die Lebensdauer des Devices bestehen.
+ *
+ * read liefert die Anzahl gelesener Bytes, write 0, im Fehlerfall
+ * jeweils einen negativen Fehlercode. Fehlgeschlagene Versuche werden
+ * hier nur mit dev_dbg() gemeldet, die Fehlermeldung nach dem letzten
+ * Versuch gibt ds3231_bus_access() aus.
+ */
+struct ds3231_bus_ops {
+    const char *name;
+    s32 (*read)(struct i2c_client *client, u8 reg, u8 len, u8 *buf);
+    s32 (*write)(struct i2c_client *client, u8 reg, u8 len, const u8 *buf);
+};
+
+
+/*
+ * Reines I2C: Registerzeiger schreiben, Repeated-START, dann len Bytes lesen.
+ * Der DS3231 friert die Zeitregister für die Dauer eines solchen Bursts ein,
+ * das Ergebnis ist also ein konsistenter Schnappschuss.
  */
-static s32 ds3231_write_date(const struct rtc_time *date) 
+static s32 ds3231_i2c_read(struct i2c_client *client, u8 reg, u8 len, u8 *buf)
 {
-    u8 regs[7];
     s32 ret;
-    int hour = date->tm_hour;
+    struct i2c_msg msgs[2] = {
+        {
+            .addr  = client->addr,
+            .flags = 0,
+            .len   = 1,
+            .buf   = &reg,
+        },
+        {
+            .addr  = client->addr,
+            .flags = I2C_M_RD,
+            .len   = len,
+            .buf   = buf,
+        },
+    };
 
-    mutex_lock(&i2c_lock);
-    ret = ds3231_read_block_data(DS3231_REG_SECONDS, sizeof(regs), regs);
-    mutex_unlock(&i2c_lock);
-    if(ret < 0) {
+    ret = i2c_transfer(client->adapter, msgs, ARRAY_SIZE(msgs));
+    if(ret != ARRAY_SIZE(msgs)) {
+        ret = (ret < 0) ? ret : -EIO;
+        dev_dbg(&client->dev, "Burst-Read ab Register 0x%02x fehlgeschlagen (errorn = %d).\n", reg, ret);
         return ret;
     }
+    return len;
+}
 
-    /* Datum konvertieren */
-    /* ---Date--- */
-    regs[DS3231_REG_DATE] = bin2bcd((u8) date->tm_mday & 0x3f);
 
-    /* ---Month--- */
-    regs[DS3231_REG_MONTH] &= ~0x9f;
-    regs[DS3231_REG_MONTH] |= bin2bcd((u8)(date->tm_mon + 1) & 0x1f);
+/*
+ * Reines I2C: Registerzeiger und Nutzdaten gehen in einer einzigen Nachricht
+ * raus, damit der Takt zwischen Sekunden- und Jahresregister nicht
+ * weiterlaufen kann.
+ */
+static s32 ds3231_i2c_write(struct i2c_client *client, u8 reg, u8 len, const u8 *buf)
+{
+    s32 ret;
+    u8 msg[DS3231_BURST_MAX + 1];
 
-    /* ---Year--- */
-    if( date->tm_year > 199 ){
-        regs[DS3231_REG_MONTH] |= 0x80; // set century bit
+    if(len > DS3231_BURST_MAX) {
+        return -EINVAL;
     }
-    regs[DS3231_REG_YEAR] = bin2bcd((u8)(date->tm_year%100) & 0xff);
 
-    /* ---Hour--- */
-    if(regs[DS3231_REG_HOURS] & DS3231_BIT_12H) {
-        /* 12H-Stundenformat */
-        if(hour >= 12) {
-            /* Nachmittag */
-            /* nAM Bit setzen */
-            regs[DS3231_REG_HOURS] |= DS3231_BIT_nAM;
-            hour -= 12;
-        }
-        else {
-            /* Vormittag  */
-            /* nAM Bit zurücksetzen */
-            regs[DS3231_REG_HOURS] &= ~DS3231_BIT_nAM;
-        }
-        regs[DS3231_REG_HOURS] &= ~0x1f;
-        regs[DS3231_REG_HOURS] |= bin2bcd((u8)(hour) & 0x1f);
+    msg[0] = reg;
+    memcpy(&msg[1], buf, len);
+    ret = i2c_master_send(client, msg, len + 1);
+    if(ret != len + 1) {
+        ret = (ret < 0) ? ret : -EIO;
+        dev_dbg(&client->dev, "Burst-Write ab Register 0x%02x fehlgeschlagen (errorn = %d).\n", reg, ret);
+        return ret;
     }
-    else {
-        /* 24H-Stundenformat */
-        regs[DS3231_REG_HOURS] &= ~0x3f;
-        regs[DS3231_REG_HOURS] |= bin2bcd((u8)(hour) & 0x3f);
+    return 0;
+}
+
+
+/*
+ * SMBus I2C-Block: ein Kommando pro Zugriff, für Adapter ohne reines I2C.
+ */
+static s32 ds3231_smbus_block_read(struct i2c_client *client, u8 reg, u8 len, u8 *buf)
+{
+    s32 ret;
+
+    ret = i2c_smbus_read_i2c_block_data(client, reg, len, buf);
+    if(ret != len) {
+        ret = (ret < 0) ? ret : -EIO;
+        dev_dbg(&client->dev, "Block-Read ab Register 0x%02x fehlgeschlagen (errorn = %d).\n", reg, ret);
+        return ret;
     }
+    return len;
+}
 
-    /* ---Minute--- */
-    regs[DS3231_REG_MINUTES] = bin2bcd((u8)(date->tm_min));
 
-    /* ---Seconds--- */
-    regs[DS3231_REG_SECONDS] = bin2bcd((u8)(date->tm_sec));
+static s32 ds3231_smbus_block_write(struct i2c_client *client, u8 reg, u8 len, const u8 *buf)
+{
+    s32 ret;
 
-    mutex_lock(&i2c_lock);
-    ds3231_write_block_data(DS3231_REG_SECONDS, sizeof(regs), regs);
-    mutex_unlock(&i2c_lock);
+    ret = i2c_smbus_write_i2c_block_data(client, reg, len, buf);
     if(ret < 0) {
+        dev_dbg(&client->dev, "Block-Write ab Register 0x%02x fehlgeschlagen (errorn = %d).\n", reg, ret);
         return ret;
     }
-
     return 0;
 }
 
 
 /*
- * Ueberpruefe ein Datum auf Korrektheit
+ * SMBus Einzelbytes: eine Transaktion pro Register. Langsamster Weg,
+ * funktioniert aber mit jedem SMBus-Adapter.
  */
-static u32 ds3231_check_date(const struct rtc_time *date)
+static s32 ds3231_smbus_byte_read(struct i2c_client *client, u8 reg, u8 len, u8 *buf)
 {
-    unsigned int curr_year = date->tm_year + 1900;
+    s32 i, data;
 
-    if(date->tm_sec < 0 || date->tm_sec > 59) {
-        goto check_fail;
+    for(i = 0; i < len; i++) {
+        data = i2c_smbus_read_byte_data(client, reg + i);
+        if(data < 0) {
+            dev_dbg(&client->dev, "Kann Register 0x%02x nicht lesen (errorn = %d).\n", reg + i, data);
+            return data;
+        }
+        buf[i] = (u8)data;
     }
+    return i;
+}
 
-    if(date->tm_min < 0 || date->tm_min > 59) {
-        goto check_fail;
-    }
 
-    if(date->tm_hour < 0 || date->tm_hour > 23) {
-        goto check_fail;
+static s32 ds3231_smbus_byte_write(struct i2c_client *client, u8 reg, u8 len, const u8 *buf)
+{
+    s32 i, err;
+
+    for(i = 0; i < len; i++) {
+        err = i2c_smbus_write_byte_data(client, reg + i, buf[i]);
+        if(err < 0) {
+            dev_dbg(&client->dev, "Kann Register 0x%02x nicht beschreiben (errorn = %d).\n", reg + i, err);
+            return err;
+        }
     }
+    return 0;
+}
 
-    if(date->tm_year < 100 || date->tm_year > 299) {
-        goto check_fail;
+
+static const struct ds3231_bus_ops ds3231_i2c_ops = {
+    .name  = "i2c",
+    .read  = ds3231_i2c_read,
+    .write = ds3231_i2c_write,
+};
+
+static const struct ds3231_bus_ops ds3231_smbus_block_ops = {
+    .name  = "smbus-block",
+    .read  = ds3231_smbus_block_read,
+    .write = ds3231_smbus_block_write,
+};
+
+static const struct ds3231_bus_ops ds3231_smbus_byte_ops = {
+    .name  = "smbus-byte",
+    .read  = ds3231_smbus_byte_read,
+    .write = ds3231_smbus_byte_write,
+};
+
+
+/*
+ * Wählt anhand der Fähigkeiten des Adapters das schnellste Backend aus.
+ * Liefert NULL, wenn der Adapter nicht einmal Einzelbyte-SMBus kann.
+ */
+static const struct ds3231_bus_ops *ds3231_select_bus(struct i2c_adapter *adapter)
+{
+    if(i2c_check_functionality(adapter, I2C_FUNC_I2C)) {
+        return &ds3231_i2c_ops;
     }
 
-    switch(date->tm_mon) {
-        case 0:
-        case 2:
-        case 4:
-        case 6:
-        case 7:
-        case 9:
-        case 11:
-            if(date->tm_mday < 1 || date->tm_mday > 31) {
-                goto check_fail;
-            }
-            break;
-        case 3:
-        case 5:
-        case 8:
-        case 10:
-            if(date->tm_mday < 1 || date->tm_mday > 30) {
-                goto check_fail;
-            }
-            break;
-        case 1:
-            if((curr_year % 4 == 0 && curr_year % 100 != 0) || (curr_year % 400 == 0)) {
-                if(date->tm_mday < 1 || date->tm_mday > 29) {
-                    goto check_fail;
-                }
-             }
-             else {
-                if(date->tm_mday < 1 || date->tm_mday > 28) {
-                    goto check_fail;
-                }
-            }
-            break;
-        default:
-            goto check_fail;
+    if(i2c_check_functionality(adapter, I2C_FUNC_SMBUS_READ_I2C_BLOCK |
+                                        I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+        return &ds3231_smbus_block_ops;
     }
 
-    /* Datum ist gültig. */
-    return 0;
+    if(i2c_check_functionality(adapter, I2C_FUNC_SMBUS_BYTE_DATA)) {
+        return &ds3231_smbus_byte_ops;
+    }
 
-check_fail:
-    printk("DS3231_drv: Ungültiges Datum %02d-%02d-%04d %02d:%02d:%02d",
-           date->tm_mday, date->tm_mon, date->tm_year + 1900,
-           date->tm_hour, date->tm_min, date->tm_sec);
-    return -EINVAL;
+    return NULL;
 }
 
 
 /* --------------------------------------------------------------------------------------------------------
-    Callback-Funktionen für Device-Datei
+    Zugriff auf Register des DS3231 und Hilfsfunktionen zur Datumsformatierung
    --------------------------------------------------------------------------------------------------------*/
 
 
 /*
- * Wird beim Öffnen der Datei dev/ds3231 aufgerufen
+ * Bucket des log2-Histogramms für eine Dauer in ns.
  */
-static int ds3231_dev_open(struct inode *inode, struct file *file) 
+static unsigned int ds3231_hist_bucket(s64 ns)
 {
-    printk("DS3231-drv: ds3231-Device-Datei wurde aufgerufen\n");
-    return 0;
+    if(ns <= 1) {
+        return 0;
+    }
+    return min_t(unsigned int, ilog2((u64)ns), DS3231_HIST_BUCKETS - 1);
 }
 
 
 /*
- * Wird beim Schliessen der Datei dev/ds3231 aufgerufen
+ * Zähler einer Operation erhöhen.
  */
-static int ds3231_dev_close(struct inode *inode, struct file *file) 
+static void ds3231_stat_op(struct ds3231 *ds, enum ds3231_stat_op op)
 {
-    printk("DS3231-drv: Device-Datei geschlossen\n");
-    return 0;
+    this_cpu_inc(ds->stats->ops[op]);
 }
 
 
 /*
- * Wird zum Lesen aufgerufen
+ * ds->lock nehmen und, falls gewünscht, die Wartezeit erfassen.
  */
-static int ds3231_dev_read(struct file *file, char __user *buf, size_t count, loff_t *offset) 
+static void ds3231_lock(struct ds3231 *ds)
 {
-    size_t written = 0;
-    char date_str[64];
-    struct rtc_time date;
-
-    printk("DS3231_drv: ds3231_dev_read aufgerufen\n");
-    if(*offset != 0) {
-        // End-Of-File -> Daten wurden bereits gelesen
-        *offset = 0;
-        return 0;
+    bool hist = static_branch_unlikely(&ds3231_timing);
+    bool trace = trace_ds3231_lock_wait_enabled();
+    ktime_t start;
+    s64 wait;
+
+    if(!hist && !trace) {
+        mutex_lock(&ds->lock);
+        return;
     }
 
-    /* Lese RTC Daten von DS3231 */
-    if(ds3231_read_date(&date) < 0) {
-        return -EIO;
+    start = ktime_get();
+    mutex_lock(&ds->lock);
+    wait = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    if(hist) {
+        this_cpu_inc(ds->stats->lock_hist[ds3231_hist_bucket(wait)]);
+    }
+    if(trace) {
+        trace_ds3231_lock_wait(wait);
     }
+}
 
-    /* Die Datums-Werte in den String packen. */
-    scnprintf(date_str , sizeof(date_str), "%02d.%02d.%04d %02d:%02d:%02d\n",
-              date.tm_mday, date.tm_mon + 1, date.tm_year + 1900,
-              date.tm_hour, date.tm_min, date.tm_sec);
-    written = strlen(date_str);
 
-    if(written > count) {
-        printk("ds3231_drv: Benutzer-Buffer (%d) zu klein. Es werden %d bytes benötigt\n", count, written);
+/*
+ * Fehler, bei denen sich ein erneuter Versuch lohnt (NACK, Arbitrierung
+ * verloren, Timeout).
+ */
+static bool ds3231_retryable(s32 err)
+{
+    switch(err) {
+        case -EAGAIN:
+        case -EIO:
+        case -ENXIO:
+        case -EREMOTEIO:
+        case -ETIMEDOUT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+/*
+ * Prüft den Circuit Breaker. Ist er offen, wird nicht auf den Bus
+ * zugegriffen. Nach Ablauf von breaker_cooldown_ms ist ein einzelner
+ * Versuch erlaubt (halb offen). Aufruf nur unter ds->lock.
+ */
+static bool ds3231_breaker_is_open(struct ds3231 *ds)
+{
+    if(breaker_threshold == 0 || ds->breaker.failures < breaker_threshold) {
+        return false;
+    }
+    return ktime_before(ktime_get(), ds->breaker.open_until);
+}
+
+
+/*
+ * Prüft vor einem Buszugriff, ob der Client noch da und der Circuit
+ * Breaker geschlossen ist. Aufruf nur unter ds->lock.
+ */
+static s32 ds3231_bus_check(struct ds3231 *ds)
+{
+    if(ds->removed) {
+        return -ENODEV;
+    }
+
+    if(ds3231_breaker_is_open(ds)) {
+        atomic_inc(&ds->retry_stats.short_circuits);
+        return -EBUSY;
+    }
+    return 0;
+}
+
+
+/*
+ * Buchführung nach einem einzelnen Busversuch: Trace-Event und Histogramm
+ * (falls hist bzw. trace, dann mit dessen Dauer in ns) sowie Fehlerzähler.
+ */
+static void ds3231_bus_account(struct ds3231 *ds, bool write, u8 reg, u8 len, s32 ret,
+                               s64 duration, bool hist, bool trace)
+{
+    if(trace) {
+        trace_ds3231_xfer_end(reg, len, write, ret, duration);
+    }
+    if(hist) {
+        this_cpu_inc(ds->stats->bus_hist[ds3231_hist_bucket(duration)]);
+    }
+
+    if(ret < 0) {
+        this_cpu_inc(ds->stats->errors[min_t(unsigned int, -ret, DS3231_ERRNO_MAX - 1)]);
+    }
+    else {
+        ds->breaker.failures = 0;
+    }
+}
+
+
+/*
+ * Entscheidet nach dem fehlgeschlagenen Versuch attempt, ob wiederholt
+ * wird, und wartet dann den exponentiellen Backoff ab.
+ */
+static bool ds3231_bus_retry(struct ds3231 *ds, s32 ret, unsigned int attempt, ktime_t deadline)
+{
+    unsigned int backoff;
+
+    if(!ds3231_retryable(ret) || attempt + 1 >= retries) {
+        return false;
+    }
+
+    /* Exponentieller Backoff, zwischen 50% und 100% zufällig gestreut */
+    backoff = retry_backoff_us << min(attempt, 10U);
+    backoff = backoff / 2 + prandom_u32_max(backoff / 2 + 1);
+    if(ktime_after(ktime_add_us(ktime_get(), backoff), deadline)) {
+        return false;
+    }
+
+    atomic_inc(&ds->retry_stats.retries);
+    usleep_range(backoff, backoff + backoff / 4 + 1);
+    return true;
+}
+
+
+/*
+ * Endgültig fehlgeschlagener Zugriff nach attempts Versuchen: Circuit
+ * Breaker nachführen und eine Meldung ausgeben.
+ */
+static void ds3231_bus_failed(struct ds3231 *ds, bool write, u8 reg, unsigned int attempts, s32 ret)
+{
+    atomic_inc(&ds->retry_stats.failures);
+    ds->breaker.failures++;
+    if(breaker_threshold != 0 && ds->breaker.failures >= breaker_threshold) {
+        ds->breaker.open_until = ktime_add_ms(ktime_get(), breaker_cooldown_ms);
+        atomic_inc(&ds->retry_stats.breaker_trips);
+        printk_ratelimited("DS3231_drv: %s: %u Fehler in Folge, Buszugriffe für %u ms ausgesetzt.\n",
+                           dev_name(&ds->client->dev), ds->breaker.failures, breaker_cooldown_ms);
+    }
+    else {
+        /* Eine Meldung pro endgültig fehlgeschlagenem Zugriff */
+        printk_ratelimited("DS3231_drv: %s: %s ab Register 0x%02x nach %u Versuchen fehlgeschlagen (error = %d)\n",
+                           dev_name(&ds->client->dev), write ? "Schreiben" : "Lesen", reg, attempts, ret);
+    }
+}
+
+
+/*
+ * Zeitrahmen um einen einzelnen Busversuch: vorher CLOCK_REALTIME dann
+ * CLOCK_MONOTONIC_RAW, nachher in umgekehrter Reihenfolge.
+ */
+struct ds3231_bracket {
+    struct timespec64 real_pre;
+    struct timespec64 raw_pre;
+    struct timespec64 raw_post;
+    struct timespec64 real_post;
+};
+
+
+/*
+ * Registerzugriff mit Wiederholung. Transiente Fehler werden bis zu
+ * retries mal mit exponentiellem, zufällig gestreutem Backoff wiederholt,
+ * solange retry_deadline_ms nicht überschritten wird. stamp (optional)
+ * erhält den CLOCK_MONOTONIC_RAW-Zeitpunkt des letzten Versuchs, bracket
+ * (optional) den Zeitrahmen um ihn. Mit bracket wird die Dauer aus dem
+ * Rahmen genommen, Trace und Statistik bleiben außerhalb des Rahmens.
+ * Aufruf nur unter ds->lock.
+ */
+static s32 __ds3231_bus_access(struct ds3231 *ds, bool write, u8 reg, u8 len, u8 *buf,
+                               ktime_t *stamp, struct ds3231_bracket *bracket)
+{
+    ktime_t deadline, start = 0;
+    s64 duration = 0;
+    unsigned int attempt;
+    bool hist, trace;
+    s32 ret;
+
+    ret = ds3231_bus_check(ds);
+    if(ret < 0) {
+        return ret;
+    }
+
+    deadline = ktime_add_ms(ktime_get(), retry_deadline_ms);
+    for(attempt = 0; ; attempt++) {
+        if(stamp != NULL) {
+            *stamp = ktime_get_raw();
+        }
+        trace_ds3231_xfer_start(reg, len, write);
+
+        /* Einmal pro Versuch abfragen, damit start und Ende zusammenpassen */
+        hist = static_branch_unlikely(&ds3231_timing);
+        trace = trace_ds3231_xfer_end_enabled();
+        if(bracket != NULL) {
+            /* Im Rahmen nur der Buszugriff selbst */
+            ktime_get_real_ts64(&bracket->real_pre);
+            ktime_get_raw_ts64(&bracket->raw_pre);
+            ret = write ? ds->bus->write(ds->client, reg, len, buf)
+                        : ds->bus->read(ds->client, reg, len, buf);
+            ktime_get_raw_ts64(&bracket->raw_post);
+            ktime_get_real_ts64(&bracket->real_post);
+            duration = timespec64_to_ns(&bracket->raw_post) - timespec64_to_ns(&bracket->raw_pre);
+        }
+        else {
+            if(hist || trace) {
+                start = ktime_get();
+            }
+            ret = write ? ds->bus->write(ds->client, reg, len, buf)
+                        : ds->bus->read(ds->client, reg, len, buf);
+            if(hist || trace) {
+                duration = ktime_to_ns(ktime_sub(ktime_get(), start));
+            }
+        }
+        ds3231_bus_account(ds, write, reg, len, ret, duration, hist, trace);
+
+        if(ret >= 0) {
+            return ret;
+        }
+        if(!ds3231_bus_retry(ds, ret, attempt, deadline)) {
+            break;
+        }
+    }
+
+    ds3231_bus_failed(ds, write, reg, attempt + 1, ret);
+    return ret;
+}
+
+
+static s32 ds3231_bus_access(struct ds3231 *ds, bool write, u8 reg, u8 len, u8 *buf, ktime_t *stamp)
+{
+    return __ds3231_bus_access(ds, write, reg, len, buf, stamp, NULL);
+}
+
+
+/*
+ * Liest mehrere Bytes aus dem Register
+ */
+static s32 ds3231_read_block_data(struct ds3231 *ds, u8 reg, u8 len, u8 *buf)
+{
+    return ds3231_bus_access(ds, false, reg, len, buf, NULL);
+}
+
+
+/*
+ * Schreibt mehrere Bytes in das Register
+ */
+static s32 ds3231_write_block_data(struct ds3231 *ds, u8 reg, u8 len, u8 *buf)
+{
+    return ds3231_bus_access(ds, true, reg, len, buf, NULL);
+}
+
+
+/*
+ * Stundenregister (Zeit oder Alarm) in 0 - 23 umwandeln.
+ * 12H Format: 12 AM ist 0 Uhr, 12 PM ist 12 Uhr.
+ */
+static int ds3231_hour_from_reg(u8 reg)
+{
+    if(reg & DS3231_BIT_12H) {
+        return bcd2bin(reg & 0x1f) % 12 + ((reg & DS3231_BIT_nAM) ? 12 : 0);
+    }
+    return bcd2bin(reg & 0x3f);
+}
+
+
+/*
+ * Stunde (0 - 23) im Stundenformat mode (DS3231_BIT_12H oder 0) kodieren.
+ */
+static u8 ds3231_hour_to_reg(u8 mode, int hour)
+{
+    if(!(mode & DS3231_BIT_12H)) {
+        return bin2bcd((u8)(hour) & 0x3f);
+    }
+
+    if(hour >= 12) {
+        /* Nachmittag: nAM Bit setzen */
+        mode |= DS3231_BIT_nAM;
+        hour -= 12;
+    }
+    /* 0 Uhr bzw. 12 Uhr werden als 12 kodiert */
+    if(hour == 0) {
+        hour = 12;
+    }
+    return mode | bin2bcd((u8)(hour) & 0x1f);
+}
+
+
+/*
+ * Zeitregister (0x00 - 0x06) in Struct umwandeln
+ */
+static s32 ds3231_regs_to_date(const u8 *regs, struct rtc_time *date)
+{
+    /* Registerwerte verwerten */
+    /* ---Date--- */
+    date->tm_mday = bcd2bin(regs[DS3231_REG_DATE]);
+
+    /* ---Month--- */
+    date->tm_mon = bcd2bin(regs[DS3231_REG_MONTH] & ~DS3231_BIT_CENTURY) - 1;
+
+    /* ---Year--- */
+    /* Century-Bit gesetzt: 2100 - 2199 (so schreibt es ds3231_write_date()) */
+    date->tm_year = bcd2bin(regs[DS3231_REG_YEAR]) + 100;
+    if(regs[DS3231_REG_MONTH] & DS3231_BIT_CENTURY) {
+        date->tm_year += 100;
+    }
+
+    /* ---Hour--- */
+    date->tm_hour = ds3231_hour_from_reg(regs[DS3231_REG_HOURS]);
+
+    /* ---Minute--- */
+    date->tm_min = bcd2bin(regs[DS3231_REG_MINUTES]);
+
+    /* --- Seconds --- */
+    date->tm_sec = bcd2bin(regs[DS3231_REG_SECONDS]);
+
+    return 0;
+}
+
+
+/*
+ * Cache-Treffer prüfen. Ist der Cache gültig und jünger als cache_ms,
+ * wird die Zeit aus der Basis plus vergangener CLOCK_MONOTONIC_RAW-Zeit
+ * berechnet, umgerechnet mit der gemessenen Länge einer RTC-Sekunde.
+ * Lockfrei, darf ohne ds->lock aufgerufen werden.
+ */
+static bool ds3231_cache_lookup(struct ds3231 *ds, struct rtc_time *date)
+{
+    struct ds3231_cache snap;
+    struct ds3231_phase phase;
+    unsigned int seq;
+    ktime_t now;
+    time64_t secs, phase_secs;
+    s64 elapsed, max_age, since_edge;
+
+    if(cache_ms == 0 && refresh_ms == 0) {
+        return false;
+    }
+
+    /* Bei Hintergrund-Aktualisierung darf eine Probe eine Periode verspätet sein */
+    max_age = (s64)cache_ms * NSEC_PER_MSEC;
+    if(refresh_ms != 0) {
+        max_age = max_t(s64, max_age, ((s64)refresh_ms + MSEC_PER_SEC) * NSEC_PER_MSEC);
+    }
+
+    do {
+        seq = read_seqbegin(&ds->cache_lock);
+        snap = ds->cache;
+        phase = ds->phase;
+    } while(read_seqretry(&ds->cache_lock, seq));
+
+    if(!snap.valid) {
+        return false;
+    }
+
+    now = ktime_get_raw();
+    elapsed = ktime_to_ns(ktime_sub(now, snap.stamp));
+    if(elapsed < 0 || elapsed >= max_age) {
+        return false;
+    }
+    secs = snap.base + div64_s64(elapsed, phase.period);
+
+    /*
+     * Mit frischer kalibrierter Phase ab dem gemessenen Sekundenwechsel
+     * zählen. Die Basis wurde irgendwo in ihrer Sekunde gelesen und hinkt
+     * daher höchstens eine Sekunde nach. Liegt die Phase außerhalb, passt
+     * sie nicht zur Uhr: dann von der Hardware lesen statt zu raten.
+     */
+    if(phase.valid) {
+        since_edge = ktime_to_ns(ktime_sub(now, phase.edge));
+        if(since_edge >= 0 && since_edge < (s64)READ_ONCE(calib_s) * DS3231_CALIB_MAX_AGE * NSEC_PER_SEC) {
+            phase_secs = phase.edge_sec + div64_s64(since_edge, phase.period);
+            if(phase_secs < secs || phase_secs > secs + 1) {
+                atomic_inc(&ds->phase_misses);
+                return false;
+            }
+            secs = phase_secs;
+        }
+    }
+
+    rtc_time64_to_tm(secs, date);
+    return true;
+}
+
+
+/*
+ * Frisch gelesene Zeit als neue Cache-Basis veröffentlichen. Aufruf nur unter ds->lock.
+ */
+static void ds3231_cache_store(struct ds3231 *ds, const struct rtc_time *date, ktime_t stamp)
+{
+    write_seqlock(&ds->cache_lock);
+    ds->cache.base = rtc_tm_to_time64(date);
+    ds->cache.stamp = stamp;
+    ds->cache.valid = true;
+    write_sequnlock(&ds->cache_lock);
+}
+
+
+/*
+ * Cache verwerfen, der nächste Lesezugriff geht auf die Hardware. Aufruf nur unter ds->lock.
+ */
+static void ds3231_cache_invalidate(struct ds3231 *ds)
+{
+    write_seqlock(&ds->cache_lock);
+    ds->cache.valid = false;
+    write_sequnlock(&ds->cache_lock);
+}
+
+
+/*
+ * Kalibrierte Phase verwerfen. Das Stellen setzt den Teiler zurück, die
+ * alten Sekundenwechsel taugen daher auch nicht mehr als Bezug der
+ * Driftmessung. Die gemessene Sekundenlänge bleibt. Aufruf nur unter ds->lock.
+ */
+static void ds3231_phase_invalidate(struct ds3231 *ds)
+{
+    write_seqlock(&ds->cache_lock);
+    ds->phase.valid = false;
+    ds->phase.ref_valid = false;
+    write_sequnlock(&ds->cache_lock);
+}
+
+
+/*
+ * Driftmessung nach einer Kalibrierung: aus dem Bezug und dem neuen
+ * Sekundenwechsel edge (RTC-Zeit edge_sec) die Länge einer RTC-Sekunde
+ * bestimmen und geglättet übernehmen. Aufruf unter ds->lock und cache_lock.
+ */
+static void ds3231_phase_drift(struct ds3231 *ds, ktime_t edge, time64_t edge_sec)
+{
+    struct ds3231_phase *phase = &ds->phase;
+    time64_t n;
+    s64 measured;
+
+    if(phase->ref_valid) {
+        n = edge_sec - phase->ref_sec;
+        if(n < DS3231_DRIFT_MIN_S) {
+            return;
+        }
+        measured = div64_s64(ktime_to_ns(ktime_sub(edge, phase->ref_edge)), n);
+        if(abs(measured - (s64)NSEC_PER_SEC) <= DS3231_DRIFT_MAX_NS) {
+            if(phase->period_valid) {
+                phase->period += (measured - phase->period) / 4;
+            }
+            else {
+                phase->period = measured;
+                phase->period_valid = true;
+            }
+        }
+    }
+    phase->ref_sec = edge_sec;
+    phase->ref_edge = edge;
+    phase->ref_valid = true;
+}
+
+
+/*
+ * Letzte gültige Zeit merken, als Rückfallebene bei offenem Circuit Breaker.
+ * Aufruf nur unter ds->lock.
+ */
+static void ds3231_last_good_store(struct ds3231 *ds, const struct rtc_time *date, ktime_t stamp)
+{
+    ds->last_good.base = rtc_tm_to_time64(date);
+    ds->last_good.stamp = stamp;
+    ds->last_good.valid = true;
+    ds->last_good.stale = false;
+}
+
+
+/*
+ * Zeit aus der letzten gültigen Probe fortschreiben und als veraltet
+ * markieren. Liefert false, wenn es keine gültige Probe gibt.
+ * Aufruf nur unter ds->lock.
+ */
+static bool ds3231_last_good_lookup(struct ds3231 *ds, struct rtc_time *date)
+{
+    s64 elapsed;
+
+    if(!ds->last_good.valid) {
+        return false;
+    }
+
+    elapsed = ktime_to_ns(ktime_sub(ktime_get_raw(), ds->last_good.stamp));
+    rtc_time64_to_tm(ds->last_good.base + div_s64(max_t(s64, elapsed, 0), NSEC_PER_SEC), date);
+    ds->last_good.stale = true;
+    atomic_inc(&ds->retry_stats.stale_reads);
+    return true;
+}
+
+
+/*
+ * Zeitregister von der Hardware lesen und umwandeln. stamp erhält den
+ * CLOCK_MONOTONIC_RAW-Zeitpunkt des Zugriffs. Aufruf nur unter ds->lock.
+ */
+static s32 ds3231_read_hw(struct ds3231 *ds, struct rtc_time *date, ktime_t *stamp)
+{
+    s32 ret;
+    u8 regs[7];
+
+    ret = ds3231_bus_access(ds, false, DS3231_REG_SECONDS, sizeof(regs), regs, stamp);
+    if(ret < 0) {
+        return ret;
+    }
+
+    /* Stundenformat fällt beim Lesen ohnehin an */
+    ds->shadow.hour_mode = regs[DS3231_REG_HOURS] & DS3231_BIT_12H;
+    ds->shadow.valid = true;
+
+    ret = ds3231_regs_to_date(regs, date);
+    if(ret == 0) {
+        ds3231_last_good_store(ds, date, *stamp);
+    }
+    return ret;
+}
+
+
+/*
+ * Prüft, ob der Hardware-Lesezugriff mit der Nummer seq abgeschlossen ist.
+ */
+static bool ds3231_flight_done(struct ds3231 *ds, unsigned long seq)
+{
+    bool done;
+
+    spin_lock(&ds->flight_lock);
+    done = (ds->flight.seq != seq);
+    spin_unlock(&ds->flight_lock);
+    return done;
+}
+
+
+/*
+ * Datum aus dem Register auslesen und in Struct zurueckgeben
+ */
+static s32 ds3231_read_date(struct ds3231 *ds, struct rtc_time *date) 
+{
+    s32 ret;
+    ktime_t stamp;
+    unsigned long seq;
+
+    /* Schneller Weg: lockfrei aus dem Cache */
+    if(ds3231_cache_lookup(ds, date)) {
+        return 0;
+    }
+
+    /*
+     * Läuft bereits ein Hardware-Lesezugriff, wird auf dessen Ergebnis
+     * gewartet statt einen eigenen zu starten.
+     */
+    spin_lock(&ds->flight_lock);
+    if(ds->flight.busy) {
+        seq = ds->flight.seq;
+        spin_unlock(&ds->flight_lock);
+
+        /* Ein Signal bricht nur das Warten ab, nicht den Zugriff */
+        if(wait_event_interruptible(ds->flight_wq, ds3231_flight_done(ds, seq))) {
+            return -ERESTARTSYS;
+        }
+
+        spin_lock(&ds->flight_lock);
+        *date = ds->flight.date;
+        ret = ds->flight.ret;
+        spin_unlock(&ds->flight_lock);
+        return ret;
+    }
+    ds->flight.busy = true;
+    spin_unlock(&ds->flight_lock);
+
+    ds3231_lock(ds);
+    /* Evtl. hat ein anderer Leser den Cache inzwischen aufgefrischt */
+    if(ds3231_cache_lookup(ds, date)) {
+        ret = 0;
+        goto publish;
+    }
+
+    ret = ds3231_read_hw(ds, date, &stamp);
+    if(ret == 0 && (cache_ms != 0 || refresh_ms != 0)) {
+        ds3231_cache_store(ds, date, stamp);
+    }
+    else if(ret < 0 && breaker_threshold != 0 && ds->breaker.failures >= breaker_threshold) {
+        /* Bus gestört: letzte gültige Zeit fortschreiben statt Fehler */
+        if(ds3231_last_good_lookup(ds, date)) {
+            ret = 0;
+        }
+    }
+
+publish:
+    /*
+     * Ergebnis noch unter ds->lock an die Wartenden übergeben, damit kein
+     * Leser, der nach einem Stellen der Uhr ankommt, einen älteren
+     * Lesezugriff mitbenutzt.
+     */
+    spin_lock(&ds->flight_lock);
+    ds->flight.date = *date;
+    ds->flight.ret = ret;
+    ds->flight.busy = false;
+    ds->flight.seq++;
+    spin_unlock(&ds->flight_lock);
+    mutex_unlock(&ds->lock);
+    wake_up_all(&ds->flight_wq);
+
+    return ret;
+}
+
+
+/*
+ * Datum am Cache vorbei von der Hardware lesen und den Cache dabei
+ * auffrischen. Für Leser, die von einer 1-Hz-Flanke geweckt wurden: der
+ * Cache kann dann noch die Sekunde vor der Flanke liefern.
+ */
+static s32 ds3231_read_date_hw(struct ds3231 *ds, struct rtc_time *date)
+{
+    s32 ret;
+    ktime_t stamp;
+
+    ds3231_lock(ds);
+    ret = ds3231_read_hw(ds, date, &stamp);
+    if(ret == 0 && (cache_ms != 0 || refresh_ms != 0)) {
+        ds3231_cache_store(ds, date, stamp);
+    }
+    mutex_unlock(&ds->lock);
+    return ret;
+}
+
+
+/*
+ * Zeitpunkt in die ioctl-Struktur übernehmen.
+ */
+static void ds3231_put_timestamp(struct ds3231_timestamp *dst, const struct timespec64 *ts)
+{
+    dst->sec = ts->tv_sec;
+    dst->nsec = ts->tv_nsec;
+}
+
+
+/*
+ * Versatzmessung für DS3231_SYS_OFFSET.
+ *
+ * Liest die Zeitregister off->n_samples mal unter ds->lock direkt von
+ * der Hardware. Die Zeitstempel werden unmittelbar um den einzelnen
+ * Busversuch genommen, vorher CLOCK_REALTIME dann CLOCK_MONOTONIC_RAW,
+ * nachher in umgekehrter Reihenfolge, so dass beide Rahmen den Zugriff
+ * umschließen. Trace, Statistik und Backoff laufen außerhalb des Rahmens,
+ * ein wiederholter Versuch bekommt einen neuen Rahmen.
+ *
+ * Schlägt eine Probe endgültig fehl, werden die bis dahin gesammelten
+ * Proben geliefert und off->n_samples auf deren Anzahl gesetzt. Nur ohne
+ * eine einzige Probe liefert der Aufruf den Fehler.
+ */
+static s32 ds3231_sys_offset(struct ds3231 *ds, struct ds3231_sys_offset *off)
+{
+    struct ds3231_offset_sample *sample;
+    struct ds3231_bracket br;
+    struct rtc_time date;
+    s64 width, best_width = S64_MAX;
+    unsigned int i;
+    s32 ret = 0;
+    u8 regs[7];
+
+    if(off->n_samples == 0 || off->n_samples > DS3231_MAX_SAMPLES) {
+        return -EINVAL;
+    }
+
+    ds3231_lock(ds);
+    for(i = 0; i < off->n_samples; i++) {
+        /* Prüfung, Wiederholung und Fehlerbuchführung wie bei jedem Zugriff */
+        ret = __ds3231_bus_access(ds, false, DS3231_REG_SECONDS, sizeof(regs), regs, NULL, &br);
+        if(ret < 0) {
+            break;
+        }
+
+        ds->shadow.hour_mode = regs[DS3231_REG_HOURS] & DS3231_BIT_12H;
+        ds->shadow.valid = true;
+        ret = ds3231_regs_to_date(regs, &date);
+        if(ret < 0) {
+            break;
+        }
+
+        sample = &off->ts[i];
+        ds3231_put_timestamp(&sample->real_pre, &br.real_pre);
+        ds3231_put_timestamp(&sample->raw_pre, &br.raw_pre);
+        sample->rtc_sec = rtc_tm_to_time64(&date);
+        ds3231_put_timestamp(&sample->raw_post, &br.raw_post);
+        ds3231_put_timestamp(&sample->real_post, &br.real_post);
+
+        width = timespec64_to_ns(&br.real_post) - timespec64_to_ns(&br.real_pre);
+        if(width < best_width) {
+            best_width = width;
+            off->best = i;
+        }
+    }
+    mutex_unlock(&ds->lock);
+
+    /* Bereits gesammelte Proben trotz Fehler liefern */
+    if(ret < 0 && i > 0) {
+        off->n_samples = i;
+        ret = 0;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+
+/*
+ * Datum in die Zeitregister (0x00 - 0x06) umwandeln. Das Stundenformat
+ * wird aus dem Schatten übernommen. Nur wenn dieser noch nicht gefüllt
+ * ist, muss das Stundenregister gelesen werden. Aufruf nur unter ds->lock.
+ */
+static s32 ds3231_date_to_regs(struct ds3231 *ds, const struct rtc_time *date, u8 *regs)
+{
+    s32 ret;
+    struct rtc_time wday;
+
+    if(!ds->shadow.valid) {
+        ret = ds3231_read_block_data(ds, DS3231_REG_HOURS, 1, &regs[DS3231_REG_HOURS]);
+        if(ret < 0) {
+            return ret;
+        }
+        ds->shadow.hour_mode = regs[DS3231_REG_HOURS] & DS3231_BIT_12H;
+        ds->shadow.valid = true;
+    }
+
+    /* Datum konvertieren */
+    /* ---Day--- */
+    /* Wochentag (1-7) wird aus dem Datum berechnet statt vom Device gelesen */
+    rtc_time64_to_tm(rtc_tm_to_time64(date), &wday);
+    regs[DS3231_REG_DAY] = bin2bcd((u8)(wday.tm_wday + 1));
+
+    /* ---Date--- */
+    regs[DS3231_REG_DATE] = bin2bcd((u8) date->tm_mday & 0x3f);
+
+    /* ---Month--- */
+    regs[DS3231_REG_MONTH] = bin2bcd((u8)(date->tm_mon + 1) & 0x1f);
+
+    /* ---Year--- */
+    if( date->tm_year > 199 ){
+        regs[DS3231_REG_MONTH] |= 0x80; // set century bit
+    }
+    regs[DS3231_REG_YEAR] = bin2bcd((u8)(date->tm_year%100) & 0xff);
+
+    /* ---Hour--- */
+    regs[DS3231_REG_HOURS] = ds3231_hour_to_reg(ds->shadow.hour_mode, date->tm_hour);
+
+    /* ---Minute--- */
+    regs[DS3231_REG_MINUTES] = bin2bcd((u8)(date->tm_min));
+
+    /* ---Seconds--- */
+    regs[DS3231_REG_SECONDS] = bin2bcd((u8)(date->tm_sec));
+
+    return 0;
+}
+
+
+/*
+ * Vorbereitete Zeitregister schreiben und Cache, letzte gültige Zeit und
+ * Hintergrund-Aktualisierung nachführen. Aufruf nur unter ds->lock.
+ */
+static s32 ds3231_write_regs(struct ds3231 *ds, const struct rtc_time *date, u8 *regs)
+{
+    s32 ret;
+    ktime_t stamp;
+
+    stamp = ktime_get_raw();
+    ret = ds3231_write_block_data(ds, DS3231_REG_SECONDS, 7, regs);
+    if(ret == 0) {
+        ds3231_last_good_store(ds, date, stamp);
+    }
+    /* Nach dem Stellen beim nächsten Lesen von der Hardware synchronisieren */
+    ds3231_cache_invalidate(ds);
+    /* Das Stellen setzt den Sekundenteiler zurück, Sekundenwechsel neu suchen */
+    ds->refresh.aligned = false;
+    ds->refresh.have_prev = false;
+    ds->set_seq++;
+    ds3231_phase_invalidate(ds);
+    if(calib_s != 0 && ds->refresh.active) {
+        mod_delayed_work(system_wq, &ds->calib_work, 0);
+    }
+    if(ret < 0) {
+        /* Zustand des Devices unbekannt, beim nächsten Mal neu lesen */
+        ds->shadow.valid = false;
+    }
+    return ret;
+}
+
+
+/*
+ * Datum in das Register schreiben
+ */
+static s32 ds3231_write_date(struct ds3231 *ds, const struct rtc_time *date) 
+{
+    u8 regs[7];
+    s32 ret;
+
+    ds3231_lock(ds);
+    ret = ds3231_date_to_regs(ds, date, regs);
+    if(ret == 0) {
+        ret = ds3231_write_regs(ds, date, regs);
+    }
+    mutex_unlock(&ds->lock);
+    if(ret < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Hintergrund-Aktualisierung des Zeit-Caches
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Verzögerung bis zur nächsten Probe. Solange der Sekundenwechsel gesucht
+ * wird, wird alle DS3231_ALIGN_POLL_MS abgetastet, höchstens
+ * DS3231_ALIGN_MAX_POLLS mal. Wird dabei kein Wechsel gefunden, geht es
+ * nach period ms mit einer neuen Suche weiter. Ist der Wechsel bekannt,
+ * wird kurz hinter dem ersten Sekundenwechsel abgetastet, der mindestens
+ * period ms entfernt ist. Aufruf nur unter ds->lock.
+ */
+static unsigned long ds3231_refresh_delay(struct ds3231 *ds, unsigned int period)
+{
+    ktime_t now = ktime_get_raw();
+    ktime_t next;
+    s64 target, k, sec_ns;
+
+    if(!ds->refresh.aligned) {
+        if(ds->refresh.polls < DS3231_ALIGN_MAX_POLLS) {
+            ds->refresh.polls++;
+            return msecs_to_jiffies(DS3231_ALIGN_POLL_MS);
+        }
+        /* Kein Wechsel gefunden, Suche später von vorn beginnen */
+        ds->refresh.polls = 0;
+        ds->refresh.have_prev = false;
+        return msecs_to_jiffies(period);
+    }
+    ds->refresh.polls = 0;
+
+    /* Sekundenwechsel im Abstand der gemessenen Sekundenlänge */
+    sec_ns = ds->phase.period;
+    target = ktime_to_ns(ktime_sub(now, ds->refresh.edge)) + (s64)period * NSEC_PER_MSEC;
+    k = div64_s64(target + sec_ns - 1, sec_ns);
+    next = ktime_add_ns(ds->refresh.edge, k * sec_ns + DS3231_ALIGN_MARGIN_MS * NSEC_PER_MSEC);
+    if(ktime_before(next, now)) {
+        return 0;
+    }
+    return nsecs_to_jiffies(ktime_to_ns(ktime_sub(next, now)));
+}
+
+
+/*
+ * Worker der Hintergrund-Aktualisierung. Liest den DS3231, führt die Lage
+ * des Sekundenwechsels nach und veröffentlicht die Zeit im Cache.
+ */
+static void ds3231_refresh_fn(struct work_struct *work)
+{
+    struct ds3231 *ds = container_of(to_delayed_work(work), struct ds3231, refresh_work);
+    struct rtc_time date;
+    ktime_t stamp;
+    time64_t secs;
+    s64 since_edge;
+    unsigned long delay;
+    unsigned int period = READ_ONCE(refresh_ms);
+
+    if(period == 0) {
+        return;
+    }
+
+    ds3231_lock(ds);
+    if(!ds->refresh.active) {
+        mutex_unlock(&ds->lock);
+        return;
+    }
+
+    if(ds3231_read_hw(ds, &date, &stamp) != 0) {
+        ds->refresh.aligned = false;
+        ds->refresh.have_prev = false;
+        ds->refresh.polls = 0;
+        mutex_unlock(&ds->lock);
+        schedule_delayed_work(&ds->refresh_work, msecs_to_jiffies(period));
+        return;
+    }
+    secs = rtc_tm_to_time64(&date);
+
+    if(ds->refresh.aligned) {
+        /* Die Probe muss in der erwarteten Sekunde liegen, sonst neu suchen */
+        since_edge = ktime_to_ns(ktime_sub(stamp, ds->refresh.edge));
+        if(secs != ds->refresh.edge_sec + div64_s64(since_edge, ds->phase.period)) {
+            ds->refresh.aligned = false;
+        }
+    }
+    else if(ds->refresh.have_prev && secs != ds->refresh.prev) {
+        /* Sekundenwechsel zwischen letzter und dieser Probe */
+        ds->refresh.edge = stamp;
+        ds->refresh.edge_sec = secs;
+        ds->refresh.aligned = true;
+    }
+    ds->refresh.prev = secs;
+    ds->refresh.have_prev = true;
+
+    if(ds->refresh.aligned) {
+        /* Cache-Basis auf den Sekundenwechsel legen */
+        stamp = ktime_add_ns(ds->refresh.edge, (secs - ds->refresh.edge_sec) * ds->phase.period);
+    }
+    ds3231_cache_store(ds, &date, stamp);
+
+    delay = ds3231_refresh_delay(ds, period);
+    mutex_unlock(&ds->lock);
+
+    schedule_delayed_work(&ds->refresh_work, delay);
+}
+
+
+/*
+ * refresh_ms ist zur Laufzeit änderbar. Beim Einschalten wird der Worker
+ * aller Devices sofort gestartet, beim Ausschalten beendet er sich beim
+ * nächsten Lauf.
+ */
+static int ds3231_refresh_ms_set(const char *val, const struct kernel_param *kp)
+{
+    struct ds3231 *ds;
+    int ret;
+
+    ret = param_set_uint(val, kp);
+    if(ret < 0) {
+        return ret;
+    }
+
+    mutex_lock(&ds3231_devices_lock);
+    list_for_each_entry(ds, &ds3231_devices, node) {
+        ds3231_lock(ds);
+        if(refresh_ms != 0 && ds->refresh.active) {
+            mod_delayed_work(system_wq, &ds->refresh_work, 0);
+        }
+        mutex_unlock(&ds->lock);
+    }
+    mutex_unlock(&ds3231_devices_lock);
+    return 0;
+}
+
+static const struct kernel_param_ops ds3231_refresh_ms_ops = {
+    .set = ds3231_refresh_ms_set,
+    .get = param_get_uint,
+};
+module_param_cb(refresh_ms, &ds3231_refresh_ms_ops, &refresh_ms, 0644);
+MODULE_PARM_DESC(refresh_ms, "Mindestabstand der Hintergrund-Aktualisierung in ms (0 = aus)");
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Kalibrierung der Sekundenphase
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Eine Probe der Kalibrierung. Liest die Sekunden unter ds->lock, pre und
+ * post (CLOCK_MONOTONIC_RAW) umschließen den Buszugriff und damit das
+ * Übernehmen der Zeit in die Leseregister beim START. Liefert -EAGAIN,
+ * wenn die Uhr seit Beginn der Kalibrierung gestellt wurde.
+ */
+static s32 ds3231_calib_probe(struct ds3231 *ds, unsigned long set_seq, time64_t *secs, ktime_t *pre, ktime_t *post)
+{
+    struct rtc_time date;
+    s32 ret;
+    u8 regs[7];
+
+    ds3231_lock(ds);
+    if(!ds->refresh.active || ds->set_seq != set_seq) {
+        mutex_unlock(&ds->lock);
+        return -EAGAIN;
+    }
+
+    *pre = ktime_get_raw();
+    ret = ds3231_read_block_data(ds, DS3231_REG_SECONDS, sizeof(regs), regs);
+    *post = ktime_get_raw();
+    if(ret >= 0) {
+        ds->shadow.hour_mode = regs[DS3231_REG_HOURS] & DS3231_BIT_12H;
+        ds->shadow.valid = true;
+        ret = ds3231_regs_to_date(regs, &date);
+        *secs = rtc_tm_to_time64(&date);
+    }
+    mutex_unlock(&ds->lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+
+/*
+ * Sekundenwechsel per Intervallhalbierung suchen.
+ *
+ * Die erste Probe zeigt die Sekunde secs, der nächste Wechsel liegt also
+ * zwischen ihrem Beginn und ihrem Ende plus einer Sekunde. Jede weitere
+ * Probe wird in die Mitte des Intervalls gelegt: zeigt sie noch secs,
+ * liegt der Wechsel nach ihrem Beginn, sonst vor ihrem Ende. Zwischen den
+ * Proben schläft der Worker ohne ds->lock, die Abtastrate ist dadurch
+ * durch die Halbierung vorgegeben und die Zahl der Buszugriffe auf
+ * DS3231_CALIB_PROBES begrenzt.
+ */
+static s32 ds3231_calibrate(struct ds3231 *ds)
+{
+    ktime_t lo, hi, pre, post, target, delta, edge;
+    time64_t secs, probe;
+    unsigned long set_seq;
+    unsigned int probes;
+    s32 ret;
+
+    ds3231_lock(ds);
+    set_seq = ds->set_seq;
+    mutex_unlock(&ds->lock);
+
+    ret = ds3231_calib_probe(ds, set_seq, &secs, &lo, &post);
+    if(ret < 0) {
+        return ret;
+    }
+    hi = ktime_add_ns(post, NSEC_PER_SEC);
+
+    for(probes = 1; probes < DS3231_CALIB_PROBES &&
+                    ktime_to_ns(ktime_sub(hi, lo)) > DS3231_CALIB_RES_US * NSEC_PER_USEC; probes++) {
+        target = ktime_add_ns(lo, ktime_to_ns(ktime_sub(hi, lo)) / 2);
+        delta = ktime_sub(target, ktime_get_raw());
+        if(ktime_to_ns(delta) > 0) {
+            set_current_state(TASK_UNINTERRUPTIBLE);
+            schedule_hrtimeout(&delta, HRTIMER_MODE_REL);
+        }
+
+        ret = ds3231_calib_probe(ds, set_seq, &probe, &pre, &post);
+        if(ret < 0) {
+            return ret;
+        }
+        if(probe == secs) {
+            lo = ktime_after(pre, lo) ? pre : lo;
+        }
+        else if(probe == secs + 1) {
+            hi = ktime_before(post, hi) ? post : hi;
+        }
+        else {
+            /* Weder vor noch nach dem erwarteten Wechsel, Uhr springt */
+            return -EAGAIN;
+        }
+    }
+
+    ds3231_lock(ds);
+    if(ds->set_seq != set_seq) {
+        mutex_unlock(&ds->lock);
+        return -EAGAIN;
+    }
+    edge = ktime_add_ns(lo, ktime_to_ns(ktime_sub(hi, lo)) / 2);
+    write_seqlock(&ds->cache_lock);
+    ds3231_phase_drift(ds, edge, secs + 1);
+    ds->phase.edge = edge;
+    ds->phase.edge_sec = secs + 1;
+    ds->phase.uncertainty = ktime_to_ns(ktime_sub(hi, lo)) / 2;
+    ds->phase.probes = probes;
+    ds->phase.valid = true;
+    write_sequnlock(&ds->cache_lock);
+
+    /* Hintergrund-Aktualisierung direkt auf den gemessenen Wechsel setzen */
+    ds->refresh.edge = ds->phase.edge;
+    ds->refresh.edge_sec = ds->phase.edge_sec;
+    ds->refresh.aligned = true;
+    mutex_unlock(&ds->lock);
+
+    return 0;
+}
+
+
+/*
+ * Worker der Kalibrierung, läuft alle calib_s Sekunden.
+ */
+static void ds3231_calib_fn(struct work_struct *work)
+{
+    struct ds3231 *ds = container_of(to_delayed_work(work), struct ds3231, calib_work);
+    unsigned int period = READ_ONCE(calib_s);
+    s32 ret;
+
+    if(period == 0) {
+        return;
+    }
+
+    ret = ds3231_calibrate(ds);
+    if(ret < 0 && ret != -EAGAIN) {
+        printk_ratelimited("DS3231_drv: %s: Kalibrierung fehlgeschlagen (error = %d)\n",
+                           dev_name(&ds->client->dev), ret);
+    }
+
+    ds3231_lock(ds);
+    if(ds->refresh.active) {
+        /* Nach einem Stellen sofort neu messen, sonst nach der Periode */
+        schedule_delayed_work(&ds->calib_work, ret == -EAGAIN ? msecs_to_jiffies(MSEC_PER_SEC) : period * HZ);
+    }
+    mutex_unlock(&ds->lock);
+}
+
+
+/*
+ * calib_s ist zur Laufzeit änderbar. Beim Einschalten wird sofort
+ * kalibriert, beim Ausschalten beendet sich der Worker beim nächsten Lauf.
+ */
+static int ds3231_calib_s_set(const char *val, const struct kernel_param *kp)
+{
+    struct ds3231 *ds;
+    int ret;
+
+    ret = param_set_uint(val, kp);
+    if(ret < 0) {
+        return ret;
+    }
+
+    mutex_lock(&ds3231_devices_lock);
+    list_for_each_entry(ds, &ds3231_devices, node) {
+        ds3231_lock(ds);
+        if(calib_s != 0 && ds->refresh.active) {
+            mod_delayed_work(system_wq, &ds->calib_work, 0);
+        }
+        else if(calib_s == 0) {
+            ds3231_phase_invalidate(ds);
+        }
+        mutex_unlock(&ds->lock);
+    }
+    mutex_unlock(&ds3231_devices_lock);
+    return 0;
+}
+
+static const struct kernel_param_ops ds3231_calib_s_ops = {
+    .set = ds3231_calib_s_set,
+    .get = param_get_uint,
+};
+module_param_cb(calib_s, &ds3231_calib_s_ops, &calib_s, 0644);
+MODULE_PARM_DESC(calib_s, "Periode der Kalibrierung der Sekundenphase in s (0 = aus)");
+
+
+/*
+ * Ueberpruefe ein Datum auf Korrektheit
+ */
+static u32 ds3231_check_date(const struct rtc_time *date)
+{
+    unsigned int curr_year = date->tm_year + 1900;
+
+    if(date->tm_sec < 0 || date->tm_sec > 59) {
+        goto check_fail;
+    }
+
+    if(date->tm_min < 0 || date->tm_min > 59) {
+        goto check_fail;
+    }
+
+    if(date->tm_hour < 0 || date->tm_hour > 23) {
+        goto check_fail;
+    }
+
+    if(date->tm_year < 100 || date->tm_year > 299) {
+        goto check_fail;
+    }
+
+    switch(date->tm_mon) {
+        case 0:
+        case 2:
+        case 4:
+        case 6:
+        case 7:
+        case 9:
+        case 11:
+            if(date->tm_mday < 1 || date->tm_mday > 31) {
+                goto check_fail;
+            }
+            break;
+        case 3:
+        case 5:
+        case 8:
+        case 10:
+            if(date->tm_mday < 1 || date->tm_mday > 30) {
+                goto check_fail;
+            }
+            break;
+        case 1:
+            if((curr_year % 4 == 0 && curr_year % 100 != 0) || (curr_year % 400 == 0)) {
+                if(date->tm_mday < 1 || date->tm_mday > 29) {
+                    goto check_fail;
+                }
+             }
+             else {
+                if(date->tm_mday < 1 || date->tm_mday > 28) {
+                    goto check_fail;
+                }
+            }
+            break;
+        default:
+            goto check_fail;
+    }
+
+    /* Datum ist gültig. */
+    return 0;
+
+check_fail:
+    printk("DS3231_drv: Ungültiges Datum %02d-%02d-%04d %02d:%02d:%02d",
+           date->tm_mday, date->tm_mon, date->tm_year + 1900,
+           date->tm_hour, date->tm_min, date->tm_sec);
+    return -EINVAL;
+}
+
+
+/*
+ * Schläft bis zum angegebenen CLOCK_REALTIME-Zeitpunkt. Geschlafen wird
+ * relativ auf CLOCK_MONOTONIC, höchstens eine Sekunde am Stück, danach
+ * wird CLOCK_REALTIME neu gelesen. Liefert -EINTR bei einem Signal und
+ * -EAGAIN, wenn die Systemzeit so weit zurückgestellt wurde, dass der
+ * Zeitpunkt mehr als DS3231_SET_MAX_WAIT_NS entfernt ist.
+ */
+static int ds3231_sleep_until(ktime_t when)
+{
+    ktime_t rel;
+    s64 left;
+
+    for(;;) {
+        left = ktime_to_ns(ktime_sub(when, ktime_get_real()));
+        if(left <= 0) {
+            return 0;
+        }
+        if(left > DS3231_SET_MAX_WAIT_NS) {
+            return -EAGAIN;
+        }
+        if(signal_pending(current)) {
+            return -EINTR;
+        }
+
+        rel = ns_to_ktime(min_t(s64, left, NSEC_PER_SEC));
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout_range(&rel, 0, HRTIMER_MODE_REL);
+    }
+}
+
+
+/*
+ * Stellen auf den Sekundenwechsel genau.
+ *
+ * Das Schreiben des Sekundenregisters setzt den Teiler des DS3231 zurück,
+ * die neue Sekunde beginnt also mit dem Schreibzugriff. Deshalb wird nicht
+ * sofort geschrieben, sondern zu dem CLOCK_REALTIME-Zeitpunkt, an dem die
+ * gewünschte RTC-Zeit (CLOCK_REALTIME + offset_ns) eine volle Sekunde
+ * erreicht. Bis dahin schläft der Aufrufer auf einem hrtimer. I2C-Zugriffe
+ * dürfen schlafen und können daher nicht aus dem Timer-Callback erfolgen.
+ * Kurz vor dem Zeitpunkt wird ds->lock genommen und die Register kodiert,
+ * so dass zum Zeitpunkt selbst nur noch der Burst-Write läuft.
+ *
+ * now ist der CLOCK_REALTIME-Zeitpunkt, zu dem der Aufrufer offset_ns
+ * bestimmt hat. Beide beruhen so auf derselben Ablesung der Systemzeit.
+ *
+ * error erhält die gemessene Abweichung des Schreibzugriffs (Mitte
+ * zwischen Beginn und Ende) vom Sollzeitpunkt, uncertainty die halbe
+ * Dauer des Zugriffs, beides in ns. Beide dürfen NULL sein.
+ */
+static s32 ds3231_write_date_aligned(struct ds3231 *ds, ktime_t now, s64 offset_ns,
+                                     s64 *error, s64 *uncertainty)
+{
+    struct rtc_time date;
+    ktime_t when, start, end;
+    s64 next_ns;
+    time64_t secs;
+    s32 rem, ret;
+    u8 regs[7];
+
+    /* Nächste volle Sekunde der RTC-Zeit, mit etwas Vorlauf */
+    secs = div_s64_rem(ktime_to_ns(now) + offset_ns, NSEC_PER_SEC, &rem);
+    if(rem < 0) {
+        secs--;
+        rem += NSEC_PER_SEC;
+    }
+    secs++;
+    next_ns = NSEC_PER_SEC - rem;
+    if(next_ns < DS3231_SET_GUARD_US * NSEC_PER_USEC) {
+        secs++;
+        next_ns += NSEC_PER_SEC;
+    }
+    when = ktime_add_ns(now, next_ns);
+
+    rtc_time64_to_tm(secs, &date);
+    ret = ds3231_check_date(&date);
+    if(ret != 0) {
+        return ret;
+    }
+
+    /* Ohne Lock bis kurz vor den Sekundenwechsel schlafen, dann mit Lock bis dorthin */
+    ret = ds3231_sleep_until(ktime_sub_us(when, DS3231_SET_GUARD_US));
+    if(ret < 0) {
+        return ret;
+    }
+    ds3231_lock(ds);
+    ret = ds3231_date_to_regs(ds, &date, regs);
+    if(ret < 0) {
+        goto unlock;
+    }
+    ret = ds3231_sleep_until(when);
+    if(ret < 0) {
+        goto unlock;
+    }
+
+    start = ktime_get_real();
+    ret = ds3231_write_regs(ds, &date, regs);
+    end = ktime_get_real();
+
+    if(ret == 0) {
+        ds->set_error = ktime_to_ns(ktime_sub(start, when)) + ktime_to_ns(ktime_sub(end, start)) / 2;
+        ds->set_uncertainty = ktime_to_ns(ktime_sub(end, start)) / 2;
+        if(error != NULL) {
+            *error = ds->set_error;
+        }
+        if(uncertainty != NULL) {
+            *uncertainty = ds->set_uncertainty;
+        }
+    }
+
+unlock:
+    mutex_unlock(&ds->lock);
+    return ret < 0 ? ret : 0;
+}
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Update-Interrupt über den 1-Hz-Ausgang (SQW/INT)
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Control-Register aus dem Zustand des Treibers ableiten und schreiben.
+ *
+ * Der Pin SQW/INT wird entweder als Rechteckausgang (INTCN = 0) oder als
+ * Alarm-Interrupt (INTCN = 1) genutzt. Solange Update-Interrupts angefordert
+ * sind oder die PPS-Quelle ihn hält, liefert er 1 Hz (RS2 = RS1 = 0), ein
+ * Alarm wird dann bei jeder Flanke über das A1F-Flag erkannt. Sonst bleibt
+ * INTCN gesetzt und der Pin ist bis zu einem Alarm inaktiv. Aufruf nur
+ * unter ds->lock.
+ */
+static s32 ds3231_write_control(struct ds3231 *ds, u8 control)
+{
+    s32 ret;
+
+    if(ds->uie_users > 0 || ds->pps_hold) {
+        control &= ~(DS3231_BIT_INTCN | DS3231_BIT_RS2 | DS3231_BIT_RS1);
+    }
+    else {
+        control |= DS3231_BIT_INTCN;
+    }
+
+    if(control == ds->shadow.control) {
+        return 0;
+    }
+
+    ret = ds3231_write_block_data(ds, DS3231_REG_CONTROL, 1, &control);
+    if(ret == 0) {
+        ds->shadow.control = control;
+        WRITE_ONCE(ds->sqw, !(control & DS3231_BIT_INTCN));
+    }
+    return ret;
+}
+
+
+/*
+ * Update-Interrupts anfordern bzw. freigeben. Mehrere Anwender werden
+ * gezählt, der Ausgang wird beim ersten ein- und beim letzten
+ * ausgeschaltet. Liefert -EINVAL, wenn kein Interrupt verdrahtet ist.
+ * Aufruf nur unter ds->lock.
+ */
+static int __ds3231_uie_enable(struct ds3231 *ds, bool enabled)
+{
+    s32 ret;
+
+    if(ds->irq <= 0) {
+        return -EINVAL;
+    }
+
+    if(enabled) {
+        ds->uie_users++;
+    }
+    else {
+        ds->uie_users--;
+    }
+    ret = ds3231_write_control(ds, ds->shadow.control);
+    if(ret < 0) {
+        /* Zustand unverändert lassen */
+        if(enabled) {
+            ds->uie_users--;
+        }
+        else {
+            ds->uie_users++;
+        }
+    }
+    return ret;
+}
+
+
+static int ds3231_uie_enable(struct ds3231 *ds, bool enabled)
+{
+    int ret;
+
+    ds3231_lock(ds);
+    ret = __ds3231_uie_enable(ds, enabled);
+    mutex_unlock(&ds->lock);
+    return ret;
+}
+
+
+/*
+ * Update-Interrupts für eine geöffnete Datei ein- bzw. ausschalten.
+ * Prüfen und Umschalten von df->uie geschehen unter ds->lock, damit
+ * gleichzeitige ioctl()- und close()-Aufrufe derselben Datei die
+ * Anforderungen nicht doppelt zählen.
+ */
+static int ds3231_file_uie(struct ds3231_file *df, bool enabled)
+{
+    struct ds3231 *ds = df->ds;
+    int ret = 0;
+
+    ds3231_lock(ds);
+    if(df->uie != enabled) {
+        ret = __ds3231_uie_enable(ds, enabled);
+        if(ret == 0) {
+            df->uie = enabled;
+            spin_lock_irq(&ds->uie_lock);
+            df->uie_seq = ds->uie_seq;
+            spin_unlock_irq(&ds->uie_lock);
+        }
+    }
+    mutex_unlock(&ds->lock);
+    return ret;
+}
+
+
+/*
+ * SQW/INT über eine GPIO-Leitung statt über client->irq, z.B. auf Boards
+ * ohne Device-Tree-Eintrag oder zum Test mit gpio-sim: Leitung eines
+ * gpio-sim-Chips angeben und deren "pull" in sysfs zwischen pull-up und
+ * pull-down umschalten, jede fallende Flanke zählt als Sekundenwechsel.
+ */
+static int sqw_gpio = -1;
+module_param(sqw_gpio, int, 0444);
+MODULE_PARM_DESC(sqw_gpio, "GPIO-Nummer von SQW/INT, falls der Client keinen Interrupt hat (-1 = keiner)");
+
+/*
+ * PPS-Quelle aus dem 1-Hz-Ausgang. Hält den Ausgang dauerhaft an, jede
+ * Flanke wird im harten Interrupt mit Zeitstempel an das PPS-Subsystem
+ * gemeldet (/dev/ppsN, z.B. als Referenz für chrony).
+ */
+static bool pps;
+module_param(pps, bool, 0444);
+MODULE_PARM_DESC(pps, "1-Hz-Flanken als PPS-Quelle registrieren");
+
+
+/*
+ * Harter Interrupt für SQW/INT. Bei laufendem 1-Hz-Ausgang ist jeder
+ * Interrupt ein Sekundenwechsel (fallende Flanke): Zeitstempel so früh wie
+ * möglich nehmen, Flanke zählen und an die PPS-Quelle melden. Der Thread
+ * wird nur geweckt, wenn Leser warten oder ein Alarm eingeschaltet ist
+ * bzw. der Pin gerade als Alarm-Interrupt arbeitet.
+ */
+static irqreturn_t ds3231_irq(int irq, void *data)
+{
+    struct ds3231 *ds = data;
+    struct pps_device *pps_dev;
+    struct pps_event_time ts;
+    ktime_t stamp;
+
+    pps_get_ts(&ts);
+    stamp = ktime_get_raw();
+
+    if(READ_ONCE(ds->sqw)) {
+        spin_lock(&ds->uie_lock);
+        ds->uie_seq++;
+        ds->uie_stamp = stamp;
+        spin_unlock(&ds->uie_lock);
+
+        pps_dev = READ_ONCE(ds->pps);
+        if(pps_dev != NULL) {
+            pps_event(pps_dev, &ts, PPS_CAPTUREASSERT, NULL);
+        }
+
+        /* Flanke erledigt, z.B. wenn nur die PPS-Quelle den Ausgang hält */
+        if(READ_ONCE(ds->uie_users) == 0 &&
+           !(READ_ONCE(ds->shadow.control) & DS3231_BIT_A1IE)) {
+            return IRQ_HANDLED;
+        }
+    }
+
+    return IRQ_WAKE_THREAD;
+}
+
+
+/*
+ * Interrupt-Thread für SQW/INT. Bei Update-Interrupts kommt er einmal pro
+ * Sekunde und weckt die Leser, ein Alarm wird über A1F erkannt und
+ * quittiert. Ein Buszugriff ist nur bei eingeschaltetem Alarm nötig.
+ * Sobald die Flags gelesen und quittiert sind, gilt der Interrupt als
+ * behandelt, auch wenn A1F nicht gesetzt war.
+ */
+static irqreturn_t ds3231_irq_thread(int irq, void *data)
+{
+    struct ds3231 *ds = data;
+    struct rtc_device *rtc = READ_ONCE(ds->rtc);
+    bool uie, alarm = false, handled;
+    u8 status;
+
+    ds3231_lock(ds);
+    uie = ds->uie_users > 0;
+    handled = uie || ds->sqw;
+    if(ds->shadow.control & DS3231_BIT_A1IE) {
+        if(ds3231_read_block_data(ds, DS3231_REG_STATUS, 1, &status) >= 0) {
+            handled = true;
+        }
+        else {
+            status = 0;
+        }
+        if(status & DS3231_BIT_A1F) {
+            status &= ~DS3231_BIT_A1F;
+            if(ds3231_write_block_data(ds, DS3231_REG_STATUS, 1, &status) == 0) {
+                ds->shadow.status = status;
+            }
+            alarm = true;
+        }
+    }
+    mutex_unlock(&ds->lock);
+
+    if(uie) {
+        wake_up_interruptible_all(&ds->uie_wq);
+    }
+
+    if(rtc != NULL) {
+        if(uie) {
+            rtc_update_irq(rtc, 1, RTC_UF | RTC_IRQF);
+        }
+        if(alarm) {
+            rtc_update_irq(rtc, 1, RTC_AF | RTC_IRQF);
+        }
+    }
+
+    return handled ? IRQ_HANDLED : IRQ_NONE;
+}
+
+
+/*
+ * Prüft, ob seit der Flanke seq eine weitere kam.
+ */
+static bool ds3231_uie_pending(struct ds3231 *ds, unsigned long seq)
+{
+    bool pending;
+
+    spin_lock_irq(&ds->uie_lock);
+    pending = (ds->uie_seq != seq);
+    spin_unlock_irq(&ds->uie_lock);
+    return pending;
+}
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Callback-Funktionen für Device-Datei
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Wird beim Öffnen der Datei dev/ds3231 aufgerufen. Das zur Minor-Nummer
+ * gehörende Device wird für die weiteren Aufrufe in private_data abgelegt,
+ * zusammen mit dem Ausgabeformat (Voreinstellung Text).
+ */
+static int ds3231_dev_open(struct inode *inode, struct file *file) 
+{
+    struct ds3231_file *df;
+    struct ds3231 *ds;
+    int ret = 0;
+
+    trace_ds3231_fop_enter(DS3231_FOP_OPEN, 0);
+    df = kzalloc(sizeof(*df), GFP_KERNEL);
+    if(df == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* Device zur Minor-Nummer suchen und festhalten */
+    mutex_lock(&ds3231_devices_lock);
+    ds = ds3231_minors[iminor(inode)];
+    if(ds != NULL) {
+        kref_get(&ds->kref);
+    }
+    mutex_unlock(&ds3231_devices_lock);
+
+    if(ds == NULL) {
+        kfree(df);
+        ret = -ENODEV;
+        goto out;
+    }
+    df->ds = ds;
+    file->private_data = df;
+
+out:
+    trace_ds3231_fop_exit(DS3231_FOP_OPEN, ret);
+    return ret;
+}
+
+
+/*
+ * Wird beim Schliessen der Datei dev/ds3231 aufgerufen
+ */
+static int ds3231_dev_close(struct inode *inode, struct file *file) 
+{
+    struct ds3231_file *df = file->private_data;
+
+    trace_ds3231_fop_enter(DS3231_FOP_RELEASE, 0);
+    ds3231_file_uie(df, false);
+    kref_put(&df->ds->kref, ds3231_release);
+    kfree(df);
+    trace_ds3231_fop_exit(DS3231_FOP_RELEASE, 0);
+    return 0;
+}
+
+
+/*
+ * Wird zum Lesen aufgerufen
+ */
+static ssize_t __ds3231_dev_read(struct file *file, char __user *buf, size_t count, loff_t *offset) 
+{
+    struct ds3231_file *df = file->private_data;
+    struct ds3231 *ds = df->ds;
+    size_t written = 0;
+    union {
+        char str[64];
+        struct rtc_time tm;
+        __le64 secs;
+    } out;
+    struct rtc_time date;
+    u32 mode;
+    s32 ret;
+
+    if(df->uie) {
+        /*
+         * Update-Interrupts eingeschaltet: bis zur nächsten Flanke warten
+         * und dann die neue Zeit liefern, eine Zeile pro Sekunde.
+         */
+        if(!ds3231_uie_pending(ds, df->uie_seq)) {
+            if(file->f_flags & O_NONBLOCK) {
+                return -EAGAIN;
+            }
+            if(wait_event_interruptible(ds->uie_wq, ds3231_uie_pending(ds, df->uie_seq) ||
+                                                    READ_ONCE(ds->removed))) {
+                return -ERESTARTSYS;
+            }
+            if(READ_ONCE(ds->removed)) {
+                return -ENODEV;
+            }
+        }
+        spin_lock_irq(&ds->uie_lock);
+        df->uie_seq = ds->uie_seq;
+        spin_unlock_irq(&ds->uie_lock);
+        *offset = 0;
+    }
+    else if(*offset != 0) {
+        // End-Of-File -> Daten wurden bereits gelesen
+        *offset = 0;
+        return 0;
+    }
+
+    /*
+     * Lese RTC Daten von DS3231. Nicht gelesene Felder bleiben 0. Nach
+     * einer Flanke direkt von der Hardware, damit die neue Sekunde kommt.
+     */
+    memset(&date, 0, sizeof(date));
+    ret = df->uie ? ds3231_read_date_hw(ds, &date) : ds3231_read_date(ds, &date);
+    if(ret < 0) {
+        return ret == -ERESTARTSYS ? ret : -EIO;
+    }
+
+    /* Datum im gewählten Format ausgeben */
+    mode = READ_ONCE(df->mode);
+    switch(mode) {
+        case DS3231_MODE_ISO8601:
+            written = scnprintf(out.str, sizeof(out.str), "%04d-%02d-%02dT%02d:%02d:%02d\n",
+                                date.tm_year + 1900, date.tm_mon + 1, date.tm_mday,
+                                date.tm_hour, date.tm_min, date.tm_sec);
+            break;
+
+        /* Binärformate ohne Formatieren, nur vollständig */
+        case DS3231_MODE_RTC_TIME:
+            /* Wochentag, Tag im Jahr und tm_isdst wie RTC_RD_TIME füllen */
+            rtc_time64_to_tm(rtc_tm_to_time64(&date), &out.tm);
+            written = sizeof(out.tm);
+            break;
+
+        case DS3231_MODE_TIME64:
+            out.secs = cpu_to_le64(rtc_tm_to_time64(&date));
+            written = sizeof(out.secs);
+            break;
+
+        default:
+            /* Die Datums-Werte in den String packen. */
+            written = scnprintf(out.str, sizeof(out.str), "%02d.%02d.%04d %02d:%02d:%02d\n",
+                                date.tm_mday, date.tm_mon + 1, date.tm_year + 1900,
+                                date.tm_hour, date.tm_min, date.tm_sec);
+            break;
+    }
+
+    if(written > count) {
+        if(mode == DS3231_MODE_RTC_TIME || mode == DS3231_MODE_TIME64) {
+            return -EINVAL;
+        }
+        pr_debug_ratelimited("DS3231_drv: Benutzer-Buffer (%zu) zu klein. Es werden %zu bytes benötigt\n", count, written);
         written = count;
     }
 
-    if(copy_to_user(buf, date_str, written)) {
-        return -EFAULT;
-    }
+    if(copy_to_user(buf, &out, written)) {
+        return -EFAULT;
+    }
+
+    *offset = 1;
+    return written;
+}
+
+
+/*
+ * Datum aus dem mit '\0' abgeschlossenen String str der Länge count lesen
+ * und prüfen. Erwartet "YYYY-MM-DD HH:MM:SS", optional gefolgt von genau
+ * einem '\n'.
+ */
+static s32 ds3231_parse_date(const char *str, size_t count, struct rtc_time *date)
+{
+    s32 ret;
+
+    if(count > DS3231_DATE_STR_LEN + 1) {
+        printk("DS3231_drv: Argument zu Lang\n");
+        return -EINVAL;
+    }
+
+    if(count < DS3231_DATE_STR_LEN) {
+        printk("DS3231_drv: Argument zu kurz\n");
+        return -EINVAL;
+    }
+
+    /* sscanf() ignoriert Reste, ein 20. Byte darf nur der Zeilenumbruch sein */
+    if(count == DS3231_DATE_STR_LEN + 1 && str[DS3231_DATE_STR_LEN] != '\n') {
+        printk("DS3231_drv: Unerwartetes Zeichen nach dem Datum\n");
+        return -EINVAL;
+    }
+
+    if(!(str[4]  == '-' && str[7]  == '-' && str[10] == ' ' &&
+         str[13] == ':' && str[16] == ':')) {
+        printk("DS3231_drv: Falsche Formatierung des Datums\n");
+        return -EINVAL;
+    }
+
+    /* Werte aus dem String lesen */
+    memset(date, 0, sizeof(*date));
+    if(sscanf(str, "%04d-%02d-%d %d:%d:%d",
+              &date->tm_year, &date->tm_mon, &date->tm_mday,
+              &date->tm_hour, &date->tm_min, &date->tm_sec) != 6) {
+        printk("DS3231_drv: Falsche Formatierung des Datums\n");
+        return -EINVAL;
+    }
+
+    /* Wert für das Jahr anpassen */
+    date->tm_mon--;
+    date->tm_year -= 1900;
+
+    /* Werte Prüfen */
+    ret = ds3231_check_date(date);
+    if(ret != 0) {
+        printk("DS3231_drv: Ungültiges Datum (error = %d).\n", ret);
+    }
+    return ret;
+}
+
+
+/*
+ * Wird zum Schreiben aufgerufen
+ */
+static ssize_t __ds3231_dev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset) 
+{
+    struct ds3231_file *df = file->private_data;
+    struct ds3231 *ds = df->ds;
+    /* "YYYY-MM-DD HH:MM:SS", optional gefolgt von '\n' */
+    char date_str[DS3231_DATE_STR_LEN + 2];
+    struct rtc_time date;
+    s32 ret = 0;
+
+    if(count > DS3231_DATE_STR_LEN + 1) {
+        printk("DS3231_drv: Argument zu Lang\n");
+        return -EINVAL;
+    }
+
+    if(copy_from_user(date_str, buf, count) != 0) {
+        printk("DS3231_drv: Daten konnten nicht in den Kernel Space kopiert werden.\n");
+        return -EINVAL;
+    }
+    date_str[count] = '\0';
+
+    ret = ds3231_parse_date(date_str, count, &date);
+    if(ret != 0) {
+        return ret;
+    }
+
+    /* In Register schreiben */
+    ret = ds3231_write_date(ds, &date);
+    if(ret != 0) {
+        printk("DS3231_drv: Datum konnte nicht geschrieben werden (error = %d).\n", ret);
+        return ret;
+    }
+
+    return count;
+}
+
+
+/*
+ * ioctl (input output control) verarbeitet Befehle
+ */
+static long __ds3231_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg) 
+{
+    struct ds3231_file *df = file->private_data;
+    struct ds3231 *ds = df->ds;
+        struct rtc_time date;
+    struct ds3231_set_time set;
+    struct ds3231_sys_offset *off;
+    ktime_t ref, now;
+    u32 mode;
+    s64 offset;
+    s32 ret;
+
+    switch(cmd) {
+        case RTC_RD_TIME:
+            memset(&date,0,sizeof(struct rtc_time));
+            ret = ds3231_read_date(ds, &date);
+            if(ret < 0) {
+                return ret == -ERESTARTSYS ? ret : -EIO;
+            }
+            if(copy_to_user((void __user*)arg, &date, sizeof(struct rtc_time)) != 0) {
+                return -EINVAL;
+            }
+            break;
+
+        /*
+         * Die übergebene Zeit gilt für die aktuelle Sekunde der
+         * Systemzeit. Geschrieben wird beim nächsten Sekundenwechsel von
+         * CLOCK_REALTIME, die ganzzahlige Differenz bleibt erhalten.
+         */
+        case RTC_SET_TIME:
+            if(copy_from_user(&date, (struct rtc_time*)arg, sizeof(struct rtc_time)) != 0) {
+                return -EINVAL;
+            }
+
+            /* Werte Prüfen und in Register schreiben */
+            ret = ds3231_check_date(&date);
+            if(ret != 0) {
+                printk("DS3231_drv: Ungültiges Datum (error = %d)\n", ret);
+                return ret;
+            }
+
+            ref = ktime_get_real();
+            offset = (rtc_tm_to_time64(&date) - div_s64(ktime_to_ns(ref), NSEC_PER_SEC)) * NSEC_PER_SEC;
+            ret = ds3231_write_date_aligned(ds, ref, offset, NULL, NULL);
+            if(ret != 0) {
+                printk("DS3231_drv: Datum konnte nicht geschrieben werden (error = %d)\n", ret);
+                return ret;
+            }
+            break;
+
+        /*
+         * Stellen mit ns-Auflösung: rtc ist die RTC-Zeit, die zum
+         * CLOCK_REALTIME-Zeitpunkt ref gelten soll (ref = 0: beim Aufruf).
+         * Liefert die gemessene Abweichung des Schreibzugriffs zurück.
+         */
+        case DS3231_SET_TIME_TS:
+            if(copy_from_user(&set, (void __user*)arg, sizeof(set)) != 0) {
+                return -EFAULT;
+            }
+            if(set.rtc_nsec < 0 || set.rtc_nsec >= NSEC_PER_SEC ||
+               set.ref_nsec < 0 || set.ref_nsec >= NSEC_PER_SEC) {
+                return -EINVAL;
+            }
+
+            now = ktime_get_real();
+            ref = (set.ref_sec == 0 && set.ref_nsec == 0)
+                ? now : ktime_set(set.ref_sec, set.ref_nsec);
+            offset = ktime_to_ns(ktime_sub(ktime_set(set.rtc_sec, set.rtc_nsec), ref));
+            ret = ds3231_write_date_aligned(ds, now, offset, &set.error_ns, &set.uncertainty_ns);
+            if(ret != 0) {
+                printk("DS3231_drv: Datum konnte nicht geschrieben werden (error = %d)\n", ret);
+                return ret;
+            }
+            if(copy_to_user((void __user*)arg, &set, sizeof(set)) != 0) {
+                return -EFAULT;
+            }
+            break;
+
+        /*
+         * Update Interrupt Enabled.
+         * Wird für hwclock benötigt. Danach liefert read() bzw. poll()
+         * einmal pro Sekunde direkt nach dem Sekundenwechsel.
+         */
+        case RTC_UIE_ON:
+        case RTC_UIE_OFF:
+            ret = ds3231_file_uie(df, cmd == RTC_UIE_ON);
+            if(ret < 0) {
+                return ret;
+            }
+            break;
+
+        case DS3231_SYS_OFFSET:
+            off = kzalloc(sizeof(*off), GFP_KERNEL);
+            if(off == NULL) {
+                return -ENOMEM;
+            }
+            if(copy_from_user(&off->n_samples, (void __user*)arg, sizeof(off->n_samples)) != 0) {
+                kfree(off);
+                return -EFAULT;
+            }
+            ret = ds3231_sys_offset(ds, off);
+            if(ret == 0 && copy_to_user((void __user*)arg, off, sizeof(*off)) != 0) {
+                ret = -EFAULT;
+            }
+            kfree(off);
+            if(ret != 0) {
+                return ret;
+            }
+            break;
+
+        /* Ausgabeformat von read() für diese Datei */
+        case DS3231_SET_READ_MODE:
+            if(get_user(mode, (u32 __user*)arg) != 0) {
+                return -EFAULT;
+            }
+            if(mode >= DS3231_MODE_MAX) {
+                return -EINVAL;
+            }
+            WRITE_ONCE(df->mode, mode);
+            break;
+
+        case DS3231_GET_READ_MODE:
+            if(put_user(READ_ONCE(df->mode), (u32 __user*)arg) != 0) {
+                return -EFAULT;
+            }
+            break;
+
+        default:
+            printk("DS3231_drv: Unbekannter ioctl Befehl: 0x%04x \n", cmd);
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Wartet, bis ds3231_init_fn() die Hardware initialisiert hat. Liefert
+ * deren Ergebnis, -ERESTARTSYS, wenn das Warten unterbrochen wurde, oder
+ * -ENODEV, wenn der Client inzwischen entfernt wurde.
+ */
+static int ds3231_wait_ready(struct ds3231 *ds)
+{
+    if(wait_for_completion_interruptible(&ds->ready) != 0) {
+        return -ERESTARTSYS;
+    }
+    if(READ_ONCE(ds->removed)) {
+        return -ENODEV;
+    }
+    return ds->init_ret;
+}
+
+
+/*
+ * Einstiegspunkte für read, write und ioctl. Rahmen die eigentliche
+ * Verarbeitung mit Tracepoints ein und warten vorher auf die
+ * Initialisierung des Devices.
+ */
+static ssize_t ds3231_dev_read(struct file *file, char __user *buf, size_t count, loff_t *offset) 
+{
+    struct ds3231_file *df = file->private_data;
+    struct ds3231 *ds = df->ds;
+    ssize_t ret;
+
+    trace_ds3231_fop_enter(DS3231_FOP_READ, 0);
+    ds3231_stat_op(ds, DS3231_OP_READ);
+    ret = ds3231_wait_ready(ds);
+    if(ret == 0) {
+        ret = __ds3231_dev_read(file, buf, count, offset);
+    }
+    trace_ds3231_fop_exit(DS3231_FOP_READ, ret);
+    return ret;
+}
+
+static ssize_t ds3231_dev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset) 
+{
+    struct ds3231_file *df = file->private_data;
+    struct ds3231 *ds = df->ds;
+    ssize_t ret;
+
+    trace_ds3231_fop_enter(DS3231_FOP_WRITE, 0);
+    ds3231_stat_op(ds, DS3231_OP_WRITE);
+    ret = ds3231_wait_ready(ds);
+    if(ret == 0) {
+        ret = __ds3231_dev_write(file, buf, count, offset);
+    }
+    trace_ds3231_fop_exit(DS3231_FOP_WRITE, ret);
+    return ret;
+}
+
+static long ds3231_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg) 
+{
+    struct ds3231_file *df = file->private_data;
+    struct ds3231 *ds = df->ds;
+    long ret;
+
+    trace_ds3231_fop_enter(DS3231_FOP_IOCTL, cmd);
+    switch(cmd) {
+        case RTC_RD_TIME:
+            ds3231_stat_op(ds, DS3231_OP_RD_TIME);
+            break;
+        case RTC_SET_TIME:
+            ds3231_stat_op(ds, DS3231_OP_SET_TIME);
+            break;
+        case DS3231_SET_TIME_TS:
+            ds3231_stat_op(ds, DS3231_OP_SET_TIME_TS);
+            break;
+        case DS3231_SYS_OFFSET:
+            ds3231_stat_op(ds, DS3231_OP_SYS_OFFSET);
+            break;
+    }
+    ret = ds3231_wait_ready(ds);
+    if(ret == 0) {
+        ret = __ds3231_dev_ioctl(file, cmd, arg);
+    }
+    trace_ds3231_fop_exit(DS3231_FOP_IOCTL, ret);
+    return ret;
+}
+
+
+/*
+ * poll(): mit Update-Interrupts lesbar nach jeder neuen Flanke, sonst immer.
+ * Nach dem Entfernen des Clients meldet poll() EPOLLHUP.
+ */
+static __poll_t ds3231_dev_poll(struct file *file, poll_table *wait)
+{
+    struct ds3231_file *df = file->private_data;
+    struct ds3231 *ds = df->ds;
+
+    if(READ_ONCE(ds->removed)) {
+        return EPOLLHUP | EPOLLERR;
+    }
+
+    if(!df->uie) {
+        return EPOLLIN | EPOLLRDNORM;
+    }
+
+    poll_wait(file, &ds->uie_wq, wait);
+    if(READ_ONCE(ds->removed)) {
+        return EPOLLHUP | EPOLLERR;
+    }
+    return ds3231_uie_pending(ds, df->uie_seq) ? (EPOLLIN | EPOLLRDNORM) : 0;
+}
+
+
+/*
+ * Struktur für Registrierung der Callback-Funktionen
+ */
+static struct file_operations ds3231_fops = {
+        .owner          = THIS_MODULE,
+        .llseek         = no_llseek,
+        .read           = ds3231_dev_read,
+        .write          = ds3231_dev_write,
+        .unlocked_ioctl = ds3231_dev_ioctl,
+        .poll           = ds3231_dev_poll,
+        .open           = ds3231_dev_open,
+        .release        = ds3231_dev_close
+};
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Anbindung an die RTC-Klasse (/dev/rtcN)
+   --------------------------------------------------------------------------------------------------------*/
+
+
+static int ds3231_rtc_read_time(struct device *dev, struct rtc_time *tm)
+{
+    struct ds3231 *ds = dev_get_drvdata(dev);
+    int ret;
+
+    ds3231_stat_op(ds, DS3231_OP_RD_TIME);
+    ret = ds3231_wait_ready(ds);
+    if(ret < 0) {
+        return ret;
+    }
+    return ds3231_read_date(ds, tm);
+}
+
+
+static int ds3231_rtc_set_time(struct device *dev, struct rtc_time *tm)
+{
+    struct ds3231 *ds = dev_get_drvdata(dev);
+    int ret;
+
+    ds3231_stat_op(ds, DS3231_OP_SET_TIME);
+    ret = ds3231_wait_ready(ds);
+    if(ret < 0) {
+        return ret;
+    }
+    ret = ds3231_check_date(tm);
+    if(ret != 0) {
+        return ret;
+    }
+    return ds3231_write_date(ds, tm);
+}
+
+
+/*
+ * Alarm 1 lesen. Der Treiber programmiert ihn immer auf Tag des Monats,
+ * Stunde, Minute und Sekunde, Monat und Jahr sind daher unbestimmt.
+ */
+static int ds3231_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+    struct ds3231 *ds = dev_get_drvdata(dev);
+    u8 regs[4], ctrl_sts[2];
+    int ret;
+
+    ret = ds3231_wait_ready(ds);
+    if(ret < 0) {
+        return ret;
+    }
+
+    ds3231_lock(ds);
+    ret = ds3231_read_block_data(ds, DS3231_REG_ALARM1, sizeof(regs), regs);
+    if(ret >= 0) {
+        ret = ds3231_read_block_data(ds, DS3231_REG_CONTROL, sizeof(ctrl_sts), ctrl_sts);
+    }
+    if(ret >= 0) {
+        ds->shadow.control = ctrl_sts[0];
+        ds->shadow.status = ctrl_sts[1];
+    }
+    mutex_unlock(&ds->lock);
+    if(ret < 0) {
+        return ret;
+    }
+
+    alrm->time.tm_sec = bcd2bin(regs[0] & 0x7f);
+    alrm->time.tm_min = bcd2bin(regs[1] & 0x7f);
+    alrm->time.tm_hour = ds3231_hour_from_reg(regs[2]);
+    alrm->time.tm_mday = bcd2bin(regs[3] & 0x3f);
+    alrm->time.tm_mon = -1;
+    alrm->time.tm_year = -1;
+    alrm->time.tm_wday = -1;
+    alrm->time.tm_yday = -1;
+    alrm->time.tm_isdst = -1;
+
+    alrm->enabled = !!(ctrl_sts[0] & DS3231_BIT_A1IE);
+    alrm->pending = !!(ctrl_sts[1] & DS3231_BIT_A1F);
+    return 0;
+}
+
+
+/*
+ * Control-Register mit gesetztem bzw. gelöschtem A1IE schreiben. INTCN
+ * ergibt sich aus ds3231_write_control(). Aufruf nur unter ds->lock.
+ */
+static s32 ds3231_alarm_enable(struct ds3231 *ds, bool enabled)
+{
+    u8 control = ds->shadow.control;
+
+    if(enabled) {
+        control |= DS3231_BIT_A1IE;
+    }
+    else {
+        control &= ~DS3231_BIT_A1IE;
+    }
+    return ds3231_write_control(ds, control);
+}
+
+
+static int ds3231_rtc_set_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+    struct ds3231 *ds = dev_get_drvdata(dev);
+    u8 regs[4], status;
+    int ret;
+
+    ret = ds3231_wait_ready(ds);
+    if(ret < 0) {
+        return ret;
+    }
+
+    ds3231_lock(ds);
+
+    /* Alarm während der Änderung abschalten, damit er nicht halb gesetzt auslöst */
+    ret = ds3231_alarm_enable(ds, false);
+    if(ret < 0) {
+        goto unlock;
+    }
+
+    /* A1M1-A1M4 = 0: Vergleich von Datum, Stunde, Minute und Sekunde */
+    regs[0] = bin2bcd(alrm->time.tm_sec);
+    regs[1] = bin2bcd(alrm->time.tm_min);
+    regs[2] = ds3231_hour_to_reg(ds->shadow.hour_mode, alrm->time.tm_hour);
+    regs[3] = bin2bcd(alrm->time.tm_mday);
+    ret = ds3231_write_block_data(ds, DS3231_REG_ALARM1, sizeof(regs), regs);
+    if(ret < 0) {
+        goto unlock;
+    }
+
+    /* Altes Alarm-Flag löschen, die übrigen Statusbits bleiben erhalten */
+    ret = ds3231_read_block_data(ds, DS3231_REG_STATUS, 1, &status);
+    if(ret < 0) {
+        goto unlock;
+    }
+    status &= ~DS3231_BIT_A1F;
+    ret = ds3231_write_block_data(ds, DS3231_REG_STATUS, 1, &status);
+    if(ret < 0) {
+        goto unlock;
+    }
+    ds->shadow.status = status;
+
+    if(alrm->enabled) {
+        ret = ds3231_alarm_enable(ds, true);
+    }
+
+unlock:
+    mutex_unlock(&ds->lock);
+    return ret < 0 ? ret : 0;
+}
+
+
+static int ds3231_rtc_alarm_irq_enable(struct device *dev, unsigned int enabled)
+{
+    struct ds3231 *ds = dev_get_drvdata(dev);
+    int ret;
+
+    ret = ds3231_wait_ready(ds);
+    if(ret < 0) {
+        return ret;
+    }
+
+    ds3231_lock(ds);
+    ret = ds3231_alarm_enable(ds, enabled);
+    mutex_unlock(&ds->lock);
+    return ret;
+}
+
+
+static const struct rtc_class_ops ds3231_rtc_ops = {
+    .read_time        = ds3231_rtc_read_time,
+    .set_time         = ds3231_rtc_set_time,
+    .read_alarm       = ds3231_rtc_read_alarm,
+    .set_alarm        = ds3231_rtc_set_alarm,
+    .alarm_irq_enable = ds3231_rtc_alarm_irq_enable,
+};
+
+
+/* Erste Geraetenummer, DS3231_MAX_DEVICES Nummern ab hier */
+static dev_t ds3231_first_dev;
+/* Vergabe der Minor-Nummern */
+static DEFINE_IDA(ds3231_ida);
+/* Geraeteklasse */
+static struct class *ds3231_device_class;
+
+
+/*
+ * Alte Device-Datei /dev/ds3231 (bzw. /dev/ds3231-<n>) mit eigenem Text-
+ * und ioctl-Interface. Bleibt zur Kompatibilität erhalten, neue Anwender
+ * sollten /dev/rtcN verwenden. Mit legacy_dev=0 wird sie nicht angelegt.
+ */
+static bool legacy_dev = true;
+module_param(legacy_dev, bool, 0444);
+MODULE_PARM_DESC(legacy_dev, "Device-Datei /dev/ds3231 zusätzlich zu /dev/rtcN anlegen");
+
+
+/*
+ * Minor-Nummer vergeben und Device-Datei anlegen. Der erste Chip bleibt
+ * /dev/ds3231, weitere heißen /dev/ds3231-<n>.
+ */
+static int ds3231_legacy_add(struct ds3231 *ds)
+{
+        struct i2c_client *client = ds->client;
+        dev_t devt;
+        int ret;
+
+        ds->id = ida_simple_get(&ds3231_ida, 0, DS3231_MAX_DEVICES, GFP_KERNEL);
+        if(ds->id < 0) {
+            printk(KERN_ALERT "DS3231_drv: Keine freie Minor-Nummer (error = %d)\n", ds->id);
+            return ds->id;
+        }
+        devt = MKDEV(MAJOR(ds3231_first_dev), ds->id);
+
+        /*
+         * Geraetedatei initialisieren. Die cdev wird eigens alloziert, da
+         * geöffnete Dateien sie über ds3231_remove() hinaus halten.
+         */
+        ds->cdev = cdev_alloc();
+        if(ds->cdev == NULL) {
+            ret = -ENOMEM;
+            goto free_id;
+        }
+        ds->cdev->ops = &ds3231_fops;
+        ds->cdev->owner = THIS_MODULE;
+
+        mutex_lock(&ds3231_devices_lock);
+        ds3231_minors[ds->id] = ds;
+        mutex_unlock(&ds3231_devices_lock);
+
+        ret = cdev_add(ds->cdev, devt, 1);
+        if(ret < 0) {
+            printk(KERN_ALERT "DS3231_drv: Device-Datei konnte nicht initialisiert werden (error = %d)\n", ret);
+            goto put_cdev;
+        }
+
+        /*
+         * Im sysfs registrieren, damit Device-Datei automatisch angelegt wird.
+         */
+        if(ds->id == 0) {
+            ds->dev = device_create(ds3231_device_class, &client->dev, devt, ds, "ds3231");
+        }
+        else {
+            ds->dev = device_create(ds3231_device_class, &client->dev, devt, ds, "ds3231-%d", ds->id);
+        }
+        if(IS_ERR(ds->dev)) {
+            printk(KERN_ALERT "DS3231_drv: Device konnte nicht erstellt werden\n");
+            ret = PTR_ERR(ds->dev);
+            ds->dev = NULL;
+            goto cleanup_cdev;
+        }
+
+        printk("DS3231_drv: %s: /dev/%s angelegt\n", dev_name(&client->dev), dev_name(ds->dev));
+        return 0;
+
+        cleanup_cdev:
+            cdev_del(ds->cdev);
+            ds->cdev = NULL;
+        put_cdev:
+            if(ds->cdev != NULL) {
+                kobject_put(&ds->cdev->kobj);
+            }
+            mutex_lock(&ds3231_devices_lock);
+            ds3231_minors[ds->id] = NULL;
+            mutex_unlock(&ds3231_devices_lock);
+        free_id:
+            ida_simple_remove(&ds3231_ida, ds->id);
+            return ret;
+}
+
+
+static void ds3231_legacy_del(struct ds3231 *ds)
+{
+        if(ds->dev == NULL) {
+                return;
+        }
+        mutex_lock(&ds3231_devices_lock);
+        ds3231_minors[ds->id] = NULL;
+        mutex_unlock(&ds3231_devices_lock);
+
+        device_destroy(ds3231_device_class, MKDEV(MAJOR(ds3231_first_dev), ds->id));
+        cdev_del(ds->cdev);
+        ds->cdev = NULL;
+        ida_simple_remove(&ds3231_ida, ds->id);
+        ds->dev = NULL;
+}
+
+
+/*
+ * sysfs-Attribut "transport": Name des gewählten Transport-Backends.
+ */
+static ssize_t transport_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+        struct ds3231 *ds = dev_get_drvdata(dev);
+
+        return scnprintf(buf, PAGE_SIZE, "%s\n", ds->bus ? ds->bus->name : "none");
+}
+static DEVICE_ATTR_RO(transport);
+
+
+/*
+ * sysfs-Attribute der Wiederholungsstrategie. "stale" ist 1, wenn der
+ * letzte Lesezugriff aus der letzten gültigen Zeit bedient wurde.
+ */
+#define DS3231_RETRY_STAT_ATTR(_name, _field)                                           \
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{                                                                                       \
+        struct ds3231 *ds = dev_get_drvdata(dev);                                       \
+                                                                                        \
+        return scnprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&ds->retry_stats._field)); \
+}                                                                                       \
+static DEVICE_ATTR_RO(_name)
+
+DS3231_RETRY_STAT_ATTR(bus_retries, retries);
+DS3231_RETRY_STAT_ATTR(bus_failures, failures);
+DS3231_RETRY_STAT_ATTR(breaker_trips, breaker_trips);
+DS3231_RETRY_STAT_ATTR(breaker_short_circuits, short_circuits);
+DS3231_RETRY_STAT_ATTR(stale_reads, stale_reads);
+
+static ssize_t stale_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+        struct ds3231 *ds = dev_get_drvdata(dev);
+
+        return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(ds->last_good.stale));
+}
+static DEVICE_ATTR_RO(stale);
+
+/*
+ * sysfs-Attribut "set_error": Abweichung und Unsicherheit des letzten
+ * Stellens auf den Sekundenwechsel in ns.
+ */
+static ssize_t set_error_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+        struct ds3231 *ds = dev_get_drvdata(dev);
+        s64 error, uncertainty;
+
+        mutex_lock(&ds->lock);
+        error = ds->set_error;
+        uncertainty = ds->set_uncertainty;
+        mutex_unlock(&ds->lock);
+
+        return scnprintf(buf, PAGE_SIZE, "%lld %lld\n", error, uncertainty);
+}
+static DEVICE_ATTR_RO(set_error);
+
+/*
+ * sysfs-Attribut "phase": Lage des letzten RTC-Sekundenwechsels in der
+ * CLOCK_MONOTONIC-Sekunde, Unsicherheit (beides ns), Anzahl Buszugriffe
+ * der letzten Kalibrierung, gemessene Drift der RTC gegen
+ * CLOCK_MONOTONIC_RAW in ppb und die Zahl der Cache-Zugriffe, bei denen
+ * die Phase nicht zur Uhr passte. "none" ohne gültige Kalibrierung.
+ */
+static ssize_t phase_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+        struct ds3231 *ds = dev_get_drvdata(dev);
+        struct ds3231_phase phase;
+        unsigned int seq;
+        ktime_t raw, edge;
+        s64 offset, since_edge;
+        s32 mono_phase;
+
+        do {
+                seq = read_seqbegin(&ds->cache_lock);
+                phase = ds->phase;
+        } while(read_seqretry(&ds->cache_lock, seq));
+
+        if(!phase.valid) {
+                return scnprintf(buf, PAGE_SIZE, "none\n");
+        }
+
+        /* Letzten Sekundenwechsel mit der gemessenen Sekundenlänge fortschreiben */
+        raw = ktime_get_raw();
+        offset = ktime_to_ns(ktime_sub(ktime_get(), raw));
+        since_edge = max_t(s64, ktime_to_ns(ktime_sub(raw, phase.edge)), 0);
+        edge = ktime_add_ns(phase.edge, div64_s64(since_edge, phase.period) * phase.period);
+        div_s64_rem(ktime_to_ns(edge) + offset, NSEC_PER_SEC, &mono_phase);
+
+        return scnprintf(buf, PAGE_SIZE, "%d %lld %u %lld %d\n", mono_phase, phase.uncertainty, phase.probes,
+                         NSEC_PER_SEC - phase.period, atomic_read(&ds->phase_misses));
+}
+static DEVICE_ATTR_RO(phase);
+
+static struct attribute *ds3231_attrs[] = {
+        &dev_attr_transport.attr,
+        &dev_attr_bus_retries.attr,
+        &dev_attr_bus_failures.attr,
+        &dev_attr_breaker_trips.attr,
+        &dev_attr_breaker_short_circuits.attr,
+        &dev_attr_stale_reads.attr,
+        &dev_attr_stale.attr,
+        &dev_attr_set_error.attr,
+        &dev_attr_phase.attr,
+        NULL
+};
+
+static const struct attribute_group ds3231_attr_group = {
+        .attrs = ds3231_attrs,
+};
+
+
+/*
+ * debugfs-Verzeichnis /sys/kernel/debug/ds3231 mit einem Unterverzeichnis
+ * pro Device (Name des I2C Clients, z.B. "1-0068") und den Statistiken.
+ * Schreiben einer beliebigen Eingabe in "reset" setzt alle Zähler zurück.
+ * "timing" im Wurzelverzeichnis schaltet die Histogramme für alle Devices
+ * ein (1) oder aus (0).
+ */
+static struct dentry *ds3231_debugfs;
+
+static const char * const ds3231_stat_op_names[DS3231_OP_MAX] = {
+        [DS3231_OP_READ]        = "read",
+        [DS3231_OP_WRITE]       = "write",
+        [DS3231_OP_RD_TIME]     = "RTC_RD_TIME",
+        [DS3231_OP_SET_TIME]    = "RTC_SET_TIME",
+        [DS3231_OP_SET_TIME_TS] = "DS3231_SET_TIME_TS",
+        [DS3231_OP_SYS_OFFSET]  = "DS3231_SYS_OFFSET",
+        [DS3231_OP_PROBE]       = "probe",
+};
+
+
+static int ds3231_timing_get(void *data, u64 *val)
+{
+        *val = static_key_enabled(&ds3231_timing);
+        return 0;
+}
+
+static int ds3231_timing_set(void *data, u64 val)
+{
+        if(val) {
+                static_branch_enable(&ds3231_timing);
+        }
+        else {
+                static_branch_disable(&ds3231_timing);
+        }
+        return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(ds3231_timing_fops, ds3231_timing_get, ds3231_timing_set, "%llu\n");
+
 
-    *offset = 1;
-    return written;
+/*
+ * Summe der per-CPU-Zähler bilden.
+ */
+static void ds3231_stats_sum(struct ds3231 *ds, struct ds3231_stats *sum)
+{
+        const struct ds3231_stats *s;
+        int cpu, i;
+
+        memset(sum, 0, sizeof(*sum));
+        for_each_possible_cpu(cpu) {
+                s = per_cpu_ptr(ds->stats, cpu);
+                for(i = 0; i < DS3231_OP_MAX; i++) {
+                        sum->ops[i] += s->ops[i];
+                }
+                for(i = 0; i < DS3231_HIST_BUCKETS; i++) {
+                        sum->bus_hist[i] += s->bus_hist[i];
+                        sum->lock_hist[i] += s->lock_hist[i];
+                }
+                for(i = 0; i < DS3231_ERRNO_MAX; i++) {
+                        sum->errors[i] += s->errors[i];
+                }
+        }
 }
 
 
 /*
- * Wird zum Schreiben aufgerufen
+ * Histogramm ausgeben, eine Zeile pro belegtem Bucket: "<von>-<bis> ns <anzahl>".
  */
-static ssize_t ds3231_dev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset) 
+static void ds3231_hist_show(struct seq_file *m, const u64 *hist)
 {
-    char date_str[count];
-    struct rtc_time date;
-    s32 ret = 0;
+        int i;
 
-    printk("DS3231_drv: ds3231_dev_write aufgerufen\n");
+        for(i = 0; i < DS3231_HIST_BUCKETS; i++) {
+                if(hist[i] != 0) {
+                        seq_printf(m, "%llu-%llu ns %llu\n",
+                                   i ? 1ULL << i : 0ULL, (1ULL << (i + 1)) - 1, hist[i]);
+                }
+        }
+}
 
-    if(count>20) {
-        printk("DS3231_drv: Argument zu Lang\n");
-        return -EINVAL;
-    }
 
-    if(copy_from_user(date_str, buf, count) != 0) {
-        printk("DS3231_drv: Daten konnten nicht in den Kernel Space kopiert werden.\n");
-        return -EINVAL;
-    }
+static int ds3231_stats_show(struct seq_file *m, void *v)
+{
+        struct ds3231 *ds = m->private;
+        struct ds3231_stats *sum;
+        int i;
 
-    if(!(date_str[4]  == '-' && date_str[7]  == '-' && date_str[10] == ' ' &&
-         date_str[13] == ':' && date_str[16] == ':')) {
-        printk("DS3231_drv: Falsche Formatierung des Datums\n");
-        return -EINVAL;
-    }
+        sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+        if(sum == NULL) {
+                return -ENOMEM;
+        }
+        ds3231_stats_sum(ds, sum);
 
-    /* Werte aus dem String lesen */
-    sscanf(date_str, "%04d-%02d-%d %d:%d:%d",
-        &date.tm_year, &date.tm_mon, &date.tm_mday,
-        &date.tm_hour, &date.tm_min, &date.tm_sec);
+        seq_puts(m, "[ops]\n");
+        for(i = 0; i < DS3231_OP_MAX; i++) {
+                seq_printf(m, "%s %llu\n", ds3231_stat_op_names[i], sum->ops[i]);
+        }
 
-    /* Wert für das Jahr anpassen */
-    date.tm_mon--;
-    date.tm_year -= 1900;
+        seq_puts(m, "[bus_latency]\n");
+        ds3231_hist_show(m, sum->bus_hist);
+
+        seq_puts(m, "[lock_wait]\n");
+        ds3231_hist_show(m, sum->lock_hist);
+
+        seq_puts(m, "[errors]\n");
+        for(i = 1; i < DS3231_ERRNO_MAX; i++) {
+                if(sum->errors[i] != 0) {
+                        if(i == DS3231_ERRNO_MAX - 1) {
+                                seq_printf(m, "other %llu\n", sum->errors[i]);
+                        }
+                        else {
+                                seq_printf(m, "-%d %llu\n", i, sum->errors[i]);
+                        }
+                }
+        }
 
-    /* Werte Prüfen und in Register schreiben */
-    ret = ds3231_check_date(&date);
-    if(ret != 0) {
-        printk("DS3231_drv: Ungültiges Datum (error = %d).\n", ret);
-        return ret;
-    }
+        kfree(sum);
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ds3231_stats);
 
-    ret = ds3231_write_date(&date);
-    if(ret != 0) {
-        printk("DS3231_drv: Datum konnte nicht geschrieben werden (error = %d).\n", ret);
-        return ret;
-    }
 
-    return count;
+static ssize_t ds3231_stats_reset_write(struct file *file, const char __user *buf,
+                                        size_t count, loff_t *ppos)
+{
+        struct ds3231 *ds = file->private_data;
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+                memset(per_cpu_ptr(ds->stats, cpu), 0, sizeof(struct ds3231_stats));
+        }
+        return count;
 }
 
+static const struct file_operations ds3231_stats_reset_fops = {
+        .owner  = THIS_MODULE,
+        .open   = simple_open,
+        .write  = ds3231_stats_reset_write,
+        .llseek = noop_llseek,
+};
+
 
 /*
- * ioctl (input output control) verarbeitet Befehle
+ * Interrupt für SQW/INT anfordern (client->irq oder sqw_gpio) und ggf.
+ * die PPS-Quelle registrieren. Ohne Interrupt läuft der Treiber ohne
+ * Update-Interrupts und PPS weiter.
  */
-static long ds3231_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg) 
+static void ds3231_setup_irq(struct ds3231 *ds)
 {
-        struct rtc_time date;
-    s32 ret;
-
-    printk("DS3231_drv: ioctl aufgerufen, cmd=0x%04x\n", cmd);
+        struct i2c_client *client = ds->client;
+        struct pps_source_info info = {
+                .mode  = PPS_CAPTUREASSERT | PPS_OFFSETASSERT |
+                         PPS_CANWAIT | PPS_TSFMT_TSPEC,
+                .owner = THIS_MODULE,
+                .dev   = &client->dev,
+        };
+        struct pps_device *pps_dev;
+        unsigned long flags = IRQF_ONESHOT;
+        int irq = client->irq;
+        int ret;
 
-    switch(cmd) {
-        case RTC_RD_TIME:
-            memset(&date,0,sizeof(struct rtc_time));
-            if(ds3231_read_date(&date) < 0) {
-                return -EIO;
-            }
-            if(copy_to_user((void __user*)arg, &date, sizeof(struct rtc_time)) != 0) {
-                return -EINVAL;
-            }
-            break;
+        if(irq <= 0 && sqw_gpio >= 0) {
+                ret = gpio_request_one(sqw_gpio, GPIOF_IN, "ds3231-sqw");
+                if(ret < 0) {
+                        printk("DS3231_drv: %s: GPIO %d nicht verfügbar (error = %d)\n",
+                               dev_name(&client->dev), sqw_gpio, ret);
+                        return;
+                }
+                ds->sqw_gpio = sqw_gpio;
+                irq = gpio_to_irq(sqw_gpio);
+                flags |= IRQF_TRIGGER_FALLING;
+        }
+        if(irq <= 0) {
+                goto free_gpio;
+        }
 
-        case RTC_SET_TIME:
-            if(copy_from_user(&date, (struct rtc_time*)arg, sizeof(struct rtc_time)) != 0) {
-                return -EINVAL;
-            }
+        ret = request_threaded_irq(irq, ds3231_irq, ds3231_irq_thread, flags,
+                                   dev_name(&client->dev), ds);
+        if(ret < 0) {
+                printk("DS3231_drv: %s: Interrupt %d nicht verfügbar (error = %d), keine Update-Interrupts\n",
+                       dev_name(&client->dev), irq, ret);
+                goto free_gpio;
+        }
+        ds->irq = irq;
 
-            /* Werte Prüfen und in Register schreiben */
-            ret = ds3231_check_date(&date);
-            if(ret != 0) {
-                printk("DS3231_drv: Ungültiges Datum (error = %d)\n", ret);
-                return ret;
-            }
+        if(!pps) {
+                return;
+        }
 
-            ret = ds3231_write_date(&date);
-            if(ret != 0) {
-                printk("DS3231_drv: Datum konnte nicht geschrieben werden (error = %d)\n", ret);
-                return ret;
-            }
-            break;
+        snprintf(info.name, PPS_MAX_NAME_LEN, "ds3231-%s", dev_name(&client->dev));
+        snprintf(info.path, PPS_MAX_NAME_LEN, "/dev/%s", ds->dev ? dev_name(ds->dev) : "");
+        pps_dev = pps_register_source(&info, PPS_CAPTUREASSERT | PPS_OFFSETASSERT);
+        if(IS_ERR(pps_dev)) {
+                printk("DS3231_drv: %s: PPS-Quelle konnte nicht registriert werden (error = %ld)\n",
+                       dev_name(&client->dev), PTR_ERR(pps_dev));
+                return;
+        }
+        WRITE_ONCE(ds->pps, pps_dev);
 
         /*
-         * Update Interrupt Enabled.
-         * Wird für hwclock benötigt.
+         * 1-Hz-Ausgang dauerhaft anfordern. Das ist keine Anforderung von
+         * Update-Interrupts: ohne Leser bleibt es beim harten Interrupt.
          */
-        case RTC_UIE_ON:
-        case RTC_UIE_OFF:
-            printk("DS3231_drv: UIE %s Befehl empfangen (0x%04x)\n",
-                   (cmd == RTC_UIE_ON)?"ON":"OFF", cmd);
-            break;
-
-        default:
-            printk("DS3231_drv: Unbekannter ioctl Befehl: 0x%04x \n", cmd);
-            return -1;
-    }
+        ds3231_lock(ds);
+        ds->pps_hold = true;
+        ret = ds3231_write_control(ds, ds->shadow.control);
+        if(ret < 0) {
+                ds->pps_hold = false;
+        }
+        mutex_unlock(&ds->lock);
+        if(ret < 0) {
+                printk("DS3231_drv: %s: 1-Hz-Ausgang konnte nicht eingeschaltet werden (error = %d)\n",
+                       dev_name(&client->dev), ret);
+                WRITE_ONCE(ds->pps, NULL);
+                pps_unregister_source(pps_dev);
+                return;
+        }
+        printk("DS3231_drv: %s: PPS-Quelle /dev/pps%d angelegt\n", dev_name(&client->dev), pps_dev->id);
+        return;
 
-    return 0;
+        free_gpio:
+            if(ds->sqw_gpio >= 0) {
+                    gpio_free(ds->sqw_gpio);
+                    ds->sqw_gpio = -1;
+            }
 }
 
 
 /*
- * Struktur für Registrierung der Callback-Funktionen
- */
-static struct file_operations ds3231_fops = {
-        .owner          = THIS_MODULE,
-        .llseek         = no_llseek,
-        .read           = ds3231_dev_read,
-        .write          = ds3231_dev_write,
-        .unlocked_ioctl = ds3231_dev_ioctl,
-        .open           = ds3231_dev_open,
-        .release        = ds3231_dev_close
-};
-
-
-/* Erste Geraetenummer */
-static dev_t ds3231_first_dev;
-/* Character Device Structure */
-static struct cdev ds3231_cdev;
-/* Geraeteklasse */
-static struct class *ds3231_device_class;
-
-
-/*
- * Initialisierung des Treibers und Devices.
+ * Hardware-Initialisierung des DS3231.
  *
- * Diese Funktion wird von Linux-Kernel aufgerufen, aber erst nachdem ein zum
- * Treiber passende Device-Information gefunden wurde. Innerhalb der Funktion
- * wird der Treiber und das Device initialisiert.
+ * Läuft als Worker nach ds3231_probe(), damit die Registerzugriffe nicht
+ * den Boot aufhalten. Leser, die vorher kommen, warten in
+ * ds3231_wait_ready() auf ds->ready.
  */
-static int ds3231_probe(struct i2c_client *client, const struct i2c_device_id *id)
+static void ds3231_init_fn(struct work_struct *work)
 {
+        struct ds3231 *ds = container_of(work, struct ds3231, init_work);
+        struct i2c_client *client = ds->client;
         int ret;
-        s32 reg0, reg1;
+        u8 regs[2];
         u8 reg_cnt, reg_sts;
+        struct rtc_time date;
+        ktime_t stamp;
 
-        printk("DS3231_drv: ds3231_probe called\n");
+        ds3231_lock(ds);
 
         /*
-         * Control und Status Register auslesen.
+         * Control und Status Register auslesen (liegen hintereinander).
          */
-        reg0 = i2c_smbus_read_byte_data(client, DS3231_REG_CONTROL);
-        reg1 = i2c_smbus_read_byte_data(client, DS3231_REG_STATUS);
-        if(reg0 < 0 || reg1 < 0) {
-                printk("DS3231_drv: Fehler beim Lesen von Control oder Status Register.\n");
-                return -ENODEV;
+        ds3231_stat_op(ds, DS3231_OP_PROBE);
+        ret = ds3231_read_block_data(ds, DS3231_REG_CONTROL, sizeof(regs), regs);
+        if(ret < 0) {
+                printk("DS3231_drv: %s: Fehler beim Lesen von Control oder Status Register.\n",
+                       dev_name(&client->dev));
+                ds->init_ret = -ENODEV;
+                goto done;
         }
-        reg_cnt = (u8)reg0;
-        reg_sts = (u8)reg1;
+        reg_cnt = regs[0];
+        reg_sts = regs[1];
         printk("DS3231_drv: Control: 0x%02X, Status: 0x%02X\n", reg_cnt, reg_sts);
 
         /*
@@ -517,11 +3332,24 @@ static int ds3231_probe(struct i2c_client *client, const struct i2c_device_id *i
                 reg_cnt &= ~DS3231_BIT_nEOSC;
         }
 
+        /*
+         * INTCN setzen: ohne freigegebenen Alarm ist SQW/INT dann inaktiv,
+         * statt nach dem Einschalten mit 8 kHz den Interrupt zu fluten.
+         */
         printk("DS3231_drv: Interrupt und Alarms abschalten\n");
-        reg_cnt &= ~(DS3231_BIT_INTCN | DS3231_BIT_A2IE | DS3231_BIT_A1IE);
+        reg_cnt &= ~(DS3231_BIT_A2IE | DS3231_BIT_A1IE);
+        reg_cnt |= DS3231_BIT_INTCN;
 
         /* Control-Register setzen */
-        i2c_smbus_write_byte_data(client, DS3231_REG_CONTROL, reg_cnt);
+        ds3231_stat_op(ds, DS3231_OP_PROBE);
+        ret = ds3231_write_block_data(ds, DS3231_REG_CONTROL, 1, &reg_cnt);
+        if(ret < 0) {
+                printk("DS3231_drv: %s: Fehler beim Schreiben des Control Registers.\n",
+                       dev_name(&client->dev));
+                ds->init_ret = -ENODEV;
+                goto done;
+        }
+        ds->shadow.control = reg_cnt;
 
         /*
          * Prüfe Oscilator zustand. Falls Fehler vorhanden, wird das Fehlerflag
@@ -529,57 +3357,159 @@ static int ds3231_probe(struct i2c_client *client, const struct i2c_device_id *i
          */
         if (reg_sts & DS3231_BIT_OSF) {
                 reg_sts &= ~DS3231_BIT_OSF;
-                i2c_smbus_write_byte_data(client, DS3231_REG_STATUS, reg_sts);
+                ds3231_stat_op(ds, DS3231_OP_PROBE);
+                ret = ds3231_write_block_data(ds, DS3231_REG_STATUS, 1, &reg_sts);
+                if(ret < 0) {
+                        printk("DS3231_drv: %s: Fehler beim Schreiben des Status Registers.\n",
+                               dev_name(&client->dev));
+                        ds->init_ret = -ENODEV;
+                        goto done;
+                }
                 printk("DS3231_drv: Oscilator Stop Flag (OSF) zurückgesetzt.\n");
         }
+        ds->shadow.status = reg_sts;
 
         /*
-         * chdev initialisieren
-         * Es wird eine Zeichenorientierte Geraetedatei in dev angelegt
+         * Erstes Lesen der Zeit. Füllt nebenbei den Schatten des
+         * Stundenformats, die letzte gültige Zeit und ggf. den Cache.
          */
+        ds3231_stat_op(ds, DS3231_OP_PROBE);
+        if(ds3231_read_hw(ds, &date, &stamp) == 0 && (cache_ms != 0 || refresh_ms != 0)) {
+                ds3231_cache_store(ds, &date, stamp);
+        }
 
-        /* Geraetenummer allozieren */
-        ret = alloc_chrdev_region(&ds3231_first_dev, 0, 1, "ds3231");
-        if(ret < 0) {
-            printk(KERN_ALERT "DS3231_drv: Device-Datei konnte nicht registriert werden (error = %d)\n", ret);
-            return ret;
+        ds->init_ret = 0;
+
+        /* Hintergrund-Aktualisierung freigeben */
+        ds->refresh.active = true;
+        if(refresh_ms != 0) {
+                schedule_delayed_work(&ds->refresh_work, 0);
+        }
+        if(calib_s != 0) {
+                schedule_delayed_work(&ds->calib_work, 0);
+        }
+
+        done:
+        mutex_unlock(&ds->lock);
+
+        /* Interrupt erst anfordern, wenn SQW/INT in einem definierten Zustand ist */
+        if(ds->init_ret == 0) {
+                ds3231_setup_irq(ds);
+        }
+        complete_all(&ds->ready);
+}
+
+
+/*
+ * Initialisierung des Treibers und Devices.
+ *
+ * Diese Funktion wird von Linux-Kernel aufgerufen, aber erst nachdem ein zum
+ * Treiber passende Device-Information gefunden wurde. Innerhalb der Funktion
+ * wird der Treiber initialisiert, die Device-Datei angelegt und das
+ * Device bei der RTC-Klasse angemeldet. Die Registerzugriffe erledigt
+ * ds3231_init_fn() im Hintergrund.
+ */
+static int ds3231_probe(struct i2c_client *client, const struct i2c_device_id *id)
+{
+        int ret;
+        struct ds3231 *ds;
+        struct rtc_device *rtc;
+
+        printk("DS3231_drv: ds3231_probe called\n");
+
+        /*
+         * Zustand des Devices anlegen und an den Client hängen.
+         */
+        ds = kzalloc(sizeof(*ds), GFP_KERNEL);
+        if(ds == NULL) {
+                return -ENOMEM;
         }
+        kref_init(&ds->kref);
+        ds->client = client;
+        mutex_init(&ds->lock);
+        seqlock_init(&ds->cache_lock);
+        spin_lock_init(&ds->flight_lock);
+        init_waitqueue_head(&ds->flight_wq);
+        INIT_DELAYED_WORK(&ds->refresh_work, ds3231_refresh_fn);
+        INIT_DELAYED_WORK(&ds->calib_work, ds3231_calib_fn);
+        INIT_WORK(&ds->init_work, ds3231_init_fn);
+        init_completion(&ds->ready);
+        INIT_LIST_HEAD(&ds->node);
+        spin_lock_init(&ds->uie_lock);
+        ds->sqw_gpio = -1;
+        ds->phase.period = NSEC_PER_SEC;
+        init_waitqueue_head(&ds->uie_wq);
+
+        ds->stats = alloc_percpu(struct ds3231_stats);
+        if(ds->stats == NULL) {
+                ret = -ENOMEM;
+                goto put_ds;
+        }
+        i2c_set_clientdata(client, ds);
 
         /*
-         * Geraetedatei initialisieren
+         * Fähigkeiten des Adapters prüfen und Transport-Backend festlegen.
          */
-        cdev_init(&ds3231_cdev, &ds3231_fops);
-        ret = cdev_add(&ds3231_cdev, ds3231_first_dev, 1);
+        ds->bus = ds3231_select_bus(client->adapter);
+        if(ds->bus == NULL) {
+                printk("DS3231_drv: Adapter unterstützt weder I2C noch SMBus-Bytezugriffe.\n");
+                ret = -ENODEV;
+                goto put_ds;
+        }
+        printk("DS3231_drv: %s: Transport-Backend: %s\n", dev_name(&client->dev), ds->bus->name);
+
+        /* Alte Device-Datei anlegen */
+        if(legacy_dev) {
+                ret = ds3231_legacy_add(ds);
+                if(ret < 0) {
+                        goto put_ds;
+                }
+        }
+
+        /* Transport-Backend und Zähler im sysfs anzeigen */
+        ret = sysfs_create_group(&client->dev.kobj, &ds3231_attr_group);
         if(ret < 0) {
-            printk(KERN_ALERT "DS3231_drv: Device-Datei konnte nicht initialisiert werden (error = %d)\n", ret);
-            goto unreg_chrdev;
+            printk(KERN_ALERT "DS3231_drv: sysfs-Attribut konnte nicht erstellt werden (error = %d)\n", ret);
+            goto cleanup_legacy;
         }
 
+        /* Statistiken im debugfs anzeigen, Fehler sind hier nicht kritisch */
+        ds->debugfs = debugfs_create_dir(dev_name(&client->dev), ds3231_debugfs);
+        debugfs_create_file("stats", 0444, ds->debugfs, ds, &ds3231_stats_fops);
+        debugfs_create_file("reset", 0200, ds->debugfs, ds, &ds3231_stats_reset_fops);
+
+        mutex_lock(&ds3231_devices_lock);
+        list_add_tail(&ds->node, &ds3231_devices);
+        mutex_unlock(&ds3231_devices_lock);
+
+        /* Registerzugriffe außerhalb des Boot-Pfads erledigen */
+        schedule_work(&ds->init_work);
+
         /*
-         * Im sysfs registrieren, damit Device-Datei automatisch angelegt wird
+         * Bei der RTC-Klasse sofort anmelden, damit hctosys das Device
+         * findet. Die RTC-Operationen warten selbst auf ds->ready, der
+         * Aufruf kann daher bis zum Ende von ds3231_init_fn() dauern.
+         * Ohne /dev/rtcN bleibt /dev/ds3231 nutzbar.
          */
-        ds3231_device_class = class_create(THIS_MODULE, "chardev");
-        if(ds3231_device_class == NULL) {
-            printk(KERN_ALERT "DS3231_drv: Class konnte nicht erstellt werden\n");
-            goto cleanup_cdev;
+        rtc = rtc_device_register("ds3231", &client->dev, &ds3231_rtc_ops, THIS_MODULE);
+        if(IS_ERR(rtc)) {
+                printk(KERN_ALERT "DS3231_drv: %s: RTC-Device konnte nicht registriert werden (error = %ld)\n",
+                       dev_name(&client->dev), PTR_ERR(rtc));
         }
-
-        if(device_create(ds3231_device_class, NULL, ds3231_first_dev, NULL, "ds3231") == NULL) {
-            printk(KERN_ALERT "DS3231_drv: Device konnte nicht erstellt werden\n");
-            goto cleanup_chrdev_class;
+        else {
+                WRITE_ONCE(ds->rtc, rtc);
+                printk("DS3231_drv: %s: /dev/%s angelegt\n", dev_name(&client->dev), dev_name(&rtc->dev));
         }
 
         /* DS3231 erfolgreich initialisiert */
         return 0;
 
         /* Resourcen freigeben */
-        cleanup_chrdev_class:
-            class_destroy(ds3231_device_class);
-        cleanup_cdev:
-            cdev_del(&ds3231_cdev);
-        unreg_chrdev:
-            unregister_chrdev_region(ds3231_first_dev, 1);
-            return -EIO;
+        cleanup_legacy:
+            ds3231_legacy_del(ds);
+        put_ds:
+            kref_put(&ds->kref, ds3231_release);
+            return ret;
 }
 
 
@@ -592,19 +3522,68 @@ static int ds3231_probe(struct i2c_client *client, const struct i2c_device_id *i
  */
 static int ds3231_remove(struct i2c_client *client)
 {
+        struct ds3231 *ds = i2c_get_clientdata(client);
+
         printk("DS3231_drv: ds3231_remove called\n");
-        device_destroy(ds3231_device_class, ds3231_first_dev);
-        class_destroy(ds3231_device_class);
-        cdev_del(&ds3231_cdev);
-        unregister_chrdev_region(ds3231_first_dev, 1);
+
+        mutex_lock(&ds3231_devices_lock);
+        list_del(&ds->node);
+        mutex_unlock(&ds3231_devices_lock);
+
+        /*
+         * Ab hier kein Buszugriff mehr. Geöffnete Dateien behalten den
+         * Zustand, bekommen aber -ENODEV, wartende Leser werden geweckt.
+         */
+        ds3231_lock(ds);
+        ds->removed = true;
+        mutex_unlock(&ds->lock);
+        wake_up_interruptible_all(&ds->uie_wq);
+        ds3231_legacy_del(ds);
+
+        /* Lief die Initialisierung nicht mehr, wartende Leser freigeben */
+        cancel_work_sync(&ds->init_work);
+        if(!completion_done(&ds->ready)) {
+                ds->init_ret = -ENODEV;
+                complete_all(&ds->ready);
+        }
+        if(ds->irq > 0) {
+                free_irq(ds->irq, ds);
+        }
+        if(ds->sqw_gpio >= 0) {
+                gpio_free(ds->sqw_gpio);
+        }
+        if(ds->pps != NULL) {
+                pps_unregister_source(ds->pps);
+        }
+        if(ds->rtc != NULL) {
+                rtc_device_unregister(ds->rtc);
+        }
+
+        ds3231_lock(ds);
+        ds->refresh.active = false;
+        mutex_unlock(&ds->lock);
+        cancel_delayed_work_sync(&ds->refresh_work);
+        cancel_delayed_work_sync(&ds->calib_work);
+        debugfs_remove_recursive(ds->debugfs);
+        sysfs_remove_group(&client->dev.kobj, &ds3231_attr_group);
+        kref_put(&ds->kref, ds3231_release);
         return 0;
 }
 
 
 /*
- * Device-Id. Wird für die Zuordnung des Treibers zum Gerät benötigt.
- * Das für den Treiber passendes Gerät mit der hier definierten Id wird
- * bei der Initialisierung des Moduls hinzugefügt.
+ * Device-Ids. Werden für die Zuordnung des Treibers zum Gerät benötigt.
+ *
+ * Im Normalfall wird der DS3231 über den Device-Tree bzw. ACPI beim Booten
+ * gefunden und der Treiber über die Match-Tabellen gebunden. Unter ACPI
+ * funktioniert außerdem PRP0001 mit dem Device-Tree-Compatible. Achtung:
+ * "maxim,ds3231" beansprucht auch rtc-ds1307 aus dem Kernelbaum, es darf
+ * nur einer der beiden Treiber geladen sein.
+ *
+ * Die I2C-Id gilt für Devices, die per Board-Code, über
+ * /sys/bus/i2c/devices/i2c-N/new_device oder mit den Modulparametern
+ * bus_nr und addr angelegt werden. Sie heißt bewusst nicht "ds3231", damit
+ * solche Clients nicht an rtc-ds1307 gebunden werden.
  */
 static const struct i2c_device_id ds3231_dev_id[] = {
         { "ds3231_drv", 0 },
@@ -612,6 +3591,22 @@ static const struct i2c_device_id ds3231_dev_id[] = {
 };
 MODULE_DEVICE_TABLE(i2c, ds3231_dev_id);
 
+#ifdef CONFIG_OF
+static const struct of_device_id ds3231_of_match[] = {
+        { .compatible = "maxim,ds3231" },
+        { }
+};
+MODULE_DEVICE_TABLE(of, ds3231_of_match);
+#endif
+
+#ifdef CONFIG_ACPI
+static const struct acpi_device_id ds3231_acpi_match[] = {
+        { "DS3231", 0 },
+        { }
+};
+MODULE_DEVICE_TABLE(acpi, ds3231_acpi_match);
+#endif
+
 
 /*
  * I2C Treiber-Struktur. Wird für die Registrierung des Treibers im
@@ -619,8 +3614,11 @@ MODULE_DEVICE_TABLE(i2c, ds3231_dev_id);
  */
 static struct i2c_driver ds3231_driver = {
         .driver = {
-                .owner = THIS_MODULE,
-                .name  = "ds3231_drv",
+                .owner            = THIS_MODULE,
+                .name             = "ds3231_drv",
+                .probe_type       = PROBE_PREFER_ASYNCHRONOUS,
+                .of_match_table   = of_match_ptr(ds3231_of_match),
+                .acpi_match_table = ACPI_PTR(ds3231_acpi_match),
         },
         .id_table = ds3231_dev_id,
         .probe    = ds3231_probe,
@@ -629,53 +3627,109 @@ static struct i2c_driver ds3231_driver = {
 
 
 /*
- * Initialisierungsroutine des Kernel-Modules.
- *
- * Wird beim Laden des Moduls aufgerufen. Innerhalb der Funktion
- * wird das neue Device (DS3231) registriert und der I2C Treiber
- * hinzugefügt.
+ * Rückfallebene für Boards ohne Device-Tree- oder ACPI-Eintrag: ist bus_nr
+ * gesetzt, legt ds3231_module_init() selbst einen I2C Client an dieser
+ * Adresse an. Beim Entladen des Moduls wird er wieder entfernt.
  */
-static int __init ds3231_module_init(void)
+static int bus_nr = -1;
+module_param(bus_nr, int, 0444);
+MODULE_PARM_DESC(bus_nr, "I2C-Bus für ein manuell angelegtes Device (-1 = nur Device-Tree/ACPI)");
+
+static unsigned short addr = 0x68;
+module_param(addr, ushort, 0444);
+MODULE_PARM_DESC(addr, "I2C-Adresse des manuell angelegten Devices");
+
+static struct i2c_client *ds3231_board_client;
+
+
+/*
+ * Legt den DS3231 an bus_nr/addr an. Die Referenz auf den Adapter wird
+ * nur für die Dauer der Registrierung gehalten, der Client hält den
+ * Adapter danach selbst.
+ */
+static int __init ds3231_new_board_client(void)
 {
-        int ret;
         struct i2c_adapter *adapter;
-
-        /*
-         * Normaleweise werden die Informationen bezüglich der verbauten
-         * Geräten (Devices) während der Kernel-Initialisierung mittels
-         * eines Device-Trees Eintrages definiert. Anhand dieser Informationen
-         * sucht der Kernel einen passenden Treiber für das Gerät (i2c_device_id).
-         * In unserem Fall müssen die Informationen nachträglich definiert
-         * und hinzugefügt werden.
-         */
-        const struct i2c_board_info info = {
-                I2C_BOARD_INFO("ds3231_drv", 0x68)
+        struct i2c_board_info info = {
+                I2C_BOARD_INFO("ds3231_drv", 0)
         };
+        int ret;
 
-        printk("DS3231_drv: ds3231_module_init aufgerufen\n");
+        info.addr = addr;
 
-        ds3231_client = NULL;
-        adapter = i2c_get_adapter(1);
+        adapter = i2c_get_adapter(bus_nr);
         if(adapter == NULL) {
-                printk("DS3231_drv: I2C Adapter nicht gefunden\n");
+                printk("DS3231_drv: I2C Adapter %d nicht gefunden\n", bus_nr);
                 return -ENODEV;
         }
 
         /* Neues I2C Device registrieren */
-        ds3231_client = i2c_new_device(adapter, &info);
-        if(ds3231_client == NULL) {
-                printk("DS3231_drv: I2C Client: Registrierung fehlgeschlagen\n");
-                return -ENODEV;
+        ds3231_board_client = i2c_new_client_device(adapter, &info);
+        i2c_put_adapter(adapter);
+        if(IS_ERR(ds3231_board_client)) {
+                ret = PTR_ERR(ds3231_board_client);
+                ds3231_board_client = NULL;
+                printk("DS3231_drv: I2C Client an %d-%04x: Registrierung fehlgeschlagen (error = %d)\n",
+                       bus_nr, addr, ret);
+                return ret;
+        }
+        return 0;
+}
+
+
+/*
+ * Initialisierungsroutine des Kernel-Modules.
+ *
+ * Wird beim Laden des Moduls aufgerufen. Innerhalb der Funktion wird der
+ * I2C Treiber hinzugefügt und, falls über bus_nr gewünscht, das Device
+ * (DS3231) registriert.
+ */
+static int __init ds3231_module_init(void)
+{
+        int ret;
+
+        printk("DS3231_drv: ds3231_module_init aufgerufen\n");
+
+        /* Geraetenummern für alle Devices allozieren */
+        ret = alloc_chrdev_region(&ds3231_first_dev, 0, DS3231_MAX_DEVICES, "ds3231");
+        if(ret < 0) {
+                printk(KERN_ALERT "DS3231_drv: Device-Datei konnte nicht registriert werden (error = %d)\n", ret);
+                return ret;
         }
 
-        /* Treiber registrieren */
+        ds3231_device_class = class_create(THIS_MODULE, "chardev");
+        if(IS_ERR(ds3231_device_class)) {
+                printk(KERN_ALERT "DS3231_drv: Class konnte nicht erstellt werden\n");
+                ret = PTR_ERR(ds3231_device_class);
+                goto unreg_chrdev;
+        }
+
+        ds3231_debugfs = debugfs_create_dir("ds3231", NULL);
+        debugfs_create_file_unsafe("timing", 0644, ds3231_debugfs, NULL, &ds3231_timing_fops);
+
+        /* Treiber registrieren, bereits aufgezählte Devices werden jetzt gebunden */
         ret = i2c_add_driver(&ds3231_driver);
         if(ret < 0) {
                 printk("DS3231_drv: Treiber konnte nicht hinzugefügt werden (errorn = %d)\n", ret);
-                i2c_unregister_device(ds3231_client);
-                ds3231_client = NULL;
+                goto cleanup_class;
         }
-        return ret;
+
+        if(bus_nr >= 0) {
+                ret = ds3231_new_board_client();
+                if(ret < 0) {
+                        goto del_driver;
+                }
+        }
+        return 0;
+
+        del_driver:
+            i2c_del_driver(&ds3231_driver);
+        cleanup_class:
+            debugfs_remove_recursive(ds3231_debugfs);
+            class_destroy(ds3231_device_class);
+        unreg_chrdev:
+            unregister_chrdev_region(ds3231_first_dev, DS3231_MAX_DEVICES);
+            return ret;
 }
 module_init(ds3231_module_init);
 
@@ -689,10 +3743,13 @@ module_init(ds3231_module_init);
 static void __exit ds3231_module_exit(void)
 {
         printk("DS3231_drv: ds3231_module_exit aufgerufen\n");
-        if(ds3231_client != NULL) {
-                i2c_del_driver(&ds3231_driver);
-                i2c_unregister_device(ds3231_client);
+        if(ds3231_board_client != NULL) {
+                i2c_unregister_device(ds3231_board_client);
         }
+        i2c_del_driver(&ds3231_driver);
+        debugfs_remove_recursive(ds3231_debugfs);
+        class_destroy(ds3231_device_class);
+        unregister_chrdev_region(ds3231_first_dev, DS3231_MAX_DEVICES);
 }
 module_exit(ds3231_module_exit);
 
@@ -701,3 +3758,9 @@ module_exit(ds3231_module_exit);
 MODULE_AUTHOR("Pascal Otto <uk058821@student.uni-kassel.de>");
 MODULE_DESCRIPTION("DS3231 - Real Time Clock Driver for System Ürogramming SS19");
 MODULE_LICENSE("GPL");
+
+
+/* KUnit-Tests greifen auf die statischen Funktionen dieser Datei zu */
+#ifdef CONFIG_DS3231_KUNIT_TEST
+#include "ds3231_test.c"
+#endif
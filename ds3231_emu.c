@@ -0,0 +1,871 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/i2c.h>
+#include <linux/bcd.h>
+#include <linux/rtc.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/timekeeping.h>
+#include <linux/string.h>
+#include <linux/delay.h>
+#include <linux/random.h>
+#include <linux/interrupt.h>
+#include <linux/irq_sim.h>
+
+
+/*
+ * Software-Emulator für den DS3231.
+ *
+ * Das Modul registriert einen virtuellen I2C-Adapter, an dem ein DS3231
+ * mit vollständigem Registermodell hängt: laufende Uhr, 12/24h-Modus,
+ * Century-Bit, zwei Alarme, Control/Status, Temperatur und Aging-Offset.
+ * Damit lässt sich ds3231.c ohne Hardware laden, testen und vermessen:
+ *
+ *   insmod ds3231_emu.ko bus_nr=1
+ *   insmod ds3231.ko bus_nr=1
+ *
+ * Über "mode" wird festgelegt, welche Zugriffsarten der Adapter meldet,
+ * so dass jedes Transport-Backend des Treibers ausgeübt werden kann.
+ * Mit "speed" wird jedem Zugriff die Leitungszeit eines echten Busses
+ * (100 kHz, 400 kHz oder 1 MHz) berechnet, optional mit Clock-Stretching
+ * und eingestreuten NACKs.
+ *
+ * Der Pin SQW/INT wird als simulierter Interrupt nachgebildet: bei
+ * INTCN = 0 und 1 Hz kommt er bei jedem Sekundenwechsel, bei INTCN = 1
+ * beim Setzen eines freigegebenen Alarm-Flags. Mit "client=1" legt der
+ * Emulator den DS3231 samt diesem Interrupt selbst an, so dass sich
+ * Update-Interrupts und PPS ohne Hardware ausprobieren lassen:
+ *
+ *   insmod ds3231_emu.ko client=1
+ *   insmod ds3231.ko pps=1
+ */
+
+
+/* Register des DS3231 */
+#define EMU_REG_SECONDS         0x00
+#define EMU_REG_MINUTES         0x01
+#define EMU_REG_HOURS           0x02
+# define EMU_BIT_12H            0x40
+# define EMU_BIT_nAM            0x20
+#define EMU_REG_DAY             0x03
+#define EMU_REG_DATE            0x04
+#define EMU_REG_MONTH           0x05
+# define EMU_BIT_CENTURY        0x80
+#define EMU_REG_YEAR            0x06
+#define EMU_REG_A1_SECONDS      0x07
+#define EMU_REG_A1_MINUTES      0x08
+#define EMU_REG_A1_HOURS        0x09
+#define EMU_REG_A1_DAY          0x0a
+#define EMU_REG_A2_MINUTES      0x0b
+#define EMU_REG_A2_HOURS        0x0c
+#define EMU_REG_A2_DAY          0x0d
+# define EMU_BIT_AxMx           0x80
+# define EMU_BIT_DYnDT          0x40
+#define EMU_REG_CONTROL         0x0e
+# define EMU_BIT_CONV           0x20
+# define EMU_BIT_RS2            0x10
+# define EMU_BIT_RS1            0x08
+# define EMU_BIT_INTCN          0x04
+# define EMU_BIT_A2IE           0x02
+# define EMU_BIT_A1IE           0x01
+#define EMU_REG_STATUS          0x0f
+# define EMU_BIT_OSF            0x80
+# define EMU_BIT_EN32KHZ        0x08
+# define EMU_BIT_BSY            0x04
+# define EMU_BIT_A2F            0x02
+# define EMU_BIT_A1F            0x01
+#define EMU_REG_AGING           0x10
+#define EMU_REG_TEMP_MSB        0x11
+#define EMU_REG_TEMP_LSB        0x12
+#define EMU_NREGS               0x13
+
+/* Registerwerte nach dem Einschalten laut Datenblatt */
+#define EMU_CONTROL_POR         0x1c
+#define EMU_STATUS_POR          (EMU_BIT_OSF | EMU_BIT_EN32KHZ)
+
+/* Darstellbarer Zeitraum: 2000-01-01 bis 2199-12-31 */
+#define EMU_YEAR_MIN            2000
+#define EMU_YEAR_MAX            2199
+
+
+/*
+ * Modulparameter
+ */
+static int bus_nr = -1;
+module_param(bus_nr, int, 0444);
+MODULE_PARM_DESC(bus_nr, "Nummer des virtuellen I2C-Busses (-1 = dynamisch)");
+
+static unsigned short addr = 0x68;
+module_param(addr, ushort, 0444);
+MODULE_PARM_DESC(addr, "I2C-Adresse des emulierten DS3231");
+
+static char *mode = "i2c";
+module_param(mode, charp, 0444);
+MODULE_PARM_DESC(mode, "Gemeldete Fähigkeiten: i2c, smbus-block oder smbus-byte");
+
+static bool client;
+module_param(client, bool, 0444);
+MODULE_PARM_DESC(client, "Den DS3231 mit Interrupt am virtuellen Bus selbst anlegen");
+
+static int temp_mdeg = 25000;
+module_param(temp_mdeg, int, 0644);
+MODULE_PARM_DESC(temp_mdeg, "Gemeldete Temperatur in m°C");
+
+
+enum emu_mode {
+    EMU_MODE_I2C,
+    EMU_MODE_SMBUS_BLOCK,
+    EMU_MODE_SMBUS_BYTE,
+};
+
+
+/*
+ * Zustand des emulierten Chips. Die Zeit wird nicht in den Registern
+ * gezählt, sondern aus base und dem Abstand zu stamp berechnet und erst
+ * beim Zugriff in die Register 0x00 - 0x06 übertragen (wie der
+ * Zwischenspeicher des echten Chips beim START).
+ */
+struct ds3231_emu {
+    spinlock_t lock;
+    enum emu_mode mode;
+    u8 regs[EMU_NREGS];
+    u8 ptr;                /* Registerzeiger, läuft nach 0x12 auf 0x00 über */
+    time64_t base;         /* Zeit zum Zeitpunkt stamp */
+    ktime_t stamp;         /* CLOCK_MONOTONIC eines Sekundenwechsels */
+    int dow_offset;        /* Abstand Tagesregister zu berechnetem Wochentag */
+    bool time_dirty;       /* Zeitregister im laufenden Zugriff beschrieben */
+    bool sec_written;      /* Sekundenregister beschrieben (Teiler zurücksetzen) */
+    struct hrtimer tick;   /* Sekundenwechsel, prüft die Alarme */
+    struct i2c_adapter adapter;
+    struct irq_sim irq_sim;
+    int irq;               /* Simulierter Interrupt an SQW/INT */
+    struct i2c_client *client;
+};
+
+static struct ds3231_emu emu;
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Zeitmodell
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Emulierte Zeit zum Zeitpunkt now.
+ */
+static time64_t emu_time(ktime_t now)
+{
+    s64 elapsed = ktime_to_ns(ktime_sub(now, emu.stamp));
+
+    if(elapsed < 0) {
+        elapsed = 0;
+    }
+    return emu.base + div_s64(elapsed, NSEC_PER_SEC);
+}
+
+
+/*
+ * Zeitpunkt des nächsten Sekundenwechsels nach now.
+ */
+static ktime_t emu_next_tick(ktime_t now)
+{
+    s64 elapsed = ktime_to_ns(ktime_sub(now, emu.stamp));
+
+    if(elapsed < 0) {
+        elapsed = 0;
+    }
+    return ktime_add_ns(emu.stamp, (div_s64(elapsed, NSEC_PER_SEC) + 1) * NSEC_PER_SEC);
+}
+
+
+/*
+ * Stunde im Format des 12H-Bits kodieren.
+ */
+static u8 emu_encode_hour(int hour, bool hour12)
+{
+    int h12;
+
+    if(!hour12) {
+        return bin2bcd(hour);
+    }
+
+    h12 = hour % 12;
+    if(h12 == 0) {
+        h12 = 12;
+    }
+    return EMU_BIT_12H | (hour >= 12 ? EMU_BIT_nAM : 0) | bin2bcd(h12);
+}
+
+
+/*
+ * Stundenregister (Zeit oder Alarm) in 0 - 23 umwandeln.
+ */
+static int emu_decode_hour(u8 reg)
+{
+    int hour;
+
+    if(!(reg & EMU_BIT_12H)) {
+        return bcd2bin(reg & 0x3f);
+    }
+
+    hour = bcd2bin(reg & 0x1f) % 12;
+    if(reg & EMU_BIT_nAM) {
+        hour += 12;
+    }
+    return hour;
+}
+
+
+/*
+ * Aktuelle Zeit in die Zeitregister übertragen. Das 12H-Bit bleibt
+ * erhalten, das Century-Bit wird aus dem Jahr gebildet.
+ */
+static void emu_latch(ktime_t now)
+{
+    struct rtc_time tm;
+    bool hour12 = emu.regs[EMU_REG_HOURS] & EMU_BIT_12H;
+    int year;
+
+    rtc_time64_to_tm(emu_time(now), &tm);
+    year = tm.tm_year + 1900;
+
+    emu.regs[EMU_REG_SECONDS] = bin2bcd(tm.tm_sec);
+    emu.regs[EMU_REG_MINUTES] = bin2bcd(tm.tm_min);
+    emu.regs[EMU_REG_HOURS]   = emu_encode_hour(tm.tm_hour, hour12);
+    emu.regs[EMU_REG_DAY]     = (tm.tm_wday + emu.dow_offset) % 7 + 1;
+    emu.regs[EMU_REG_DATE]    = bin2bcd(tm.tm_mday);
+    emu.regs[EMU_REG_MONTH]   = bin2bcd(tm.tm_mon + 1) | (year >= 2100 ? EMU_BIT_CENTURY : 0);
+    emu.regs[EMU_REG_YEAR]    = bin2bcd(year % 100);
+}
+
+
+/*
+ * Nach einem Zugriff mit beschriebenen Zeitregistern die neue Zeit
+ * übernehmen. Wurde das Sekundenregister beschrieben, beginnt die
+ * laufende Sekunde jetzt, ansonsten bleibt die Phase erhalten.
+ */
+static void emu_commit(ktime_t now)
+{
+    struct rtc_time tm;
+    s64 elapsed;
+    s32 frac = 0;
+    time64_t t;
+
+    if(!emu.time_dirty) {
+        return;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_sec  = bcd2bin(emu.regs[EMU_REG_SECONDS] & 0x7f);
+    tm.tm_min  = bcd2bin(emu.regs[EMU_REG_MINUTES] & 0x7f);
+    tm.tm_hour = emu_decode_hour(emu.regs[EMU_REG_HOURS]);
+    tm.tm_mday = bcd2bin(emu.regs[EMU_REG_DATE] & 0x3f);
+    tm.tm_mon  = bcd2bin(emu.regs[EMU_REG_MONTH] & 0x1f) - 1;
+    tm.tm_year = bcd2bin(emu.regs[EMU_REG_YEAR]) + 100 +
+                 ((emu.regs[EMU_REG_MONTH] & EMU_BIT_CENTURY) ? 100 : 0);
+    t = rtc_tm_to_time64(&tm);
+
+    /* Tagesregister ist frei belegbar, nur der Abstand wird gemerkt */
+    rtc_time64_to_tm(t, &tm);
+    emu.dow_offset = ((emu.regs[EMU_REG_DAY] & 0x07) + 6 - tm.tm_wday) % 7;
+
+    if(emu.sec_written) {
+        emu.stamp = now;
+    }
+    else {
+        elapsed = ktime_to_ns(ktime_sub(now, emu.stamp));
+        if(elapsed > 0) {
+            div_s64_rem(elapsed, NSEC_PER_SEC, &frac);
+        }
+        emu.stamp = ktime_sub_ns(now, frac);
+    }
+    emu.base = t;
+
+    emu.time_dirty = false;
+    emu.sec_written = false;
+    hrtimer_start(&emu.tick, emu_next_tick(now), HRTIMER_MODE_ABS);
+}
+
+
+/*
+ * Temperatur in die Register 0x11/0x12 übertragen (10 Bit, 0.25 °C).
+ */
+static void emu_update_temp(void)
+{
+    int quarter = DIV_ROUND_CLOSEST(temp_mdeg, 250);
+
+    emu.regs[EMU_REG_TEMP_MSB] = (u8)(quarter >> 2);
+    emu.regs[EMU_REG_TEMP_LSB] = (u8)((quarter & 0x03) << 6);
+}
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Alarme
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Prüft ein Alarmfeld. Ist das Maskenbit gesetzt, passt jeder Wert.
+ */
+static bool emu_field_match(u8 reg, int value)
+{
+    return (reg & EMU_BIT_AxMx) || bcd2bin(reg & 0x7f) == value;
+}
+
+
+static bool emu_day_match(u8 reg, const struct rtc_time *tm)
+{
+    if(reg & EMU_BIT_AxMx) {
+        return true;
+    }
+    if(reg & EMU_BIT_DYnDT) {
+        return (reg & 0x0f) == (tm->tm_wday + emu.dow_offset) % 7 + 1;
+    }
+    return bcd2bin(reg & 0x3f) == tm->tm_mday;
+}
+
+
+static bool emu_hour_match(u8 reg, int hour)
+{
+    return (reg & EMU_BIT_AxMx) || emu_decode_hour(reg & 0x7f) == hour;
+}
+
+
+/*
+ * INT-Ausgang im Interrupt-Modus (INTCN = 1): aktiv, solange ein
+ * freigegebenes Alarm-Flag gesetzt ist. Aufruf nur unter emu.lock.
+ */
+static bool emu_int_active(void)
+{
+    u8 control = emu.regs[EMU_REG_CONTROL];
+    u8 status = emu.regs[EMU_REG_STATUS];
+
+    return ((control & EMU_BIT_A1IE) && (status & EMU_BIT_A1F)) ||
+           ((control & EMU_BIT_A2IE) && (status & EMU_BIT_A2F));
+}
+
+
+/*
+ * Wird zu jedem Sekundenwechsel aufgerufen und setzt A1F/A2F, wenn die
+ * Zeit auf einen Alarm passt. A2 hat keine Sekunden und löst bei 00 aus.
+ */
+static enum hrtimer_restart emu_tick_fn(struct hrtimer *timer)
+{
+    struct rtc_time tm;
+    unsigned long flags;
+    ktime_t now = ktime_get();
+    u8 *r = emu.regs;
+    bool was_active, fire;
+
+    spin_lock_irqsave(&emu.lock, flags);
+    rtc_time64_to_tm(emu_time(now), &tm);
+    was_active = emu_int_active();
+
+    if(emu_field_match(r[EMU_REG_A1_SECONDS], tm.tm_sec) &&
+       emu_field_match(r[EMU_REG_A1_MINUTES], tm.tm_min) &&
+       emu_hour_match(r[EMU_REG_A1_HOURS], tm.tm_hour) &&
+       emu_day_match(r[EMU_REG_A1_DAY], &tm)) {
+        r[EMU_REG_STATUS] |= EMU_BIT_A1F;
+    }
+
+    if(tm.tm_sec == 0 &&
+       emu_field_match(r[EMU_REG_A2_MINUTES], tm.tm_min) &&
+       emu_hour_match(r[EMU_REG_A2_HOURS], tm.tm_hour) &&
+       emu_day_match(r[EMU_REG_A2_DAY], &tm)) {
+        r[EMU_REG_STATUS] |= EMU_BIT_A2F;
+    }
+
+    /* 1 Hz am SQW-Ausgang oder neu ausgelöster Alarm-Interrupt */
+    if(r[EMU_REG_CONTROL] & EMU_BIT_INTCN) {
+        fire = !was_active && emu_int_active();
+    }
+    else {
+        fire = !(r[EMU_REG_CONTROL] & (EMU_BIT_RS2 | EMU_BIT_RS1));
+    }
+
+    /* Hat emu_commit() den Timer schon neu gestartet, nicht mehr anfassen */
+    if(!hrtimer_is_queued(timer)) {
+        hrtimer_set_expires(timer, emu_next_tick(now));
+    }
+    spin_unlock_irqrestore(&emu.lock, flags);
+
+    if(fire && emu.irq > 0) {
+        irq_sim_fire(&emu.irq_sim, 0);
+    }
+
+    return HRTIMER_RESTART;
+}
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Registerzugriff
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Ein Byte ab dem Registerzeiger lesen, Zeiger weiterschalten.
+ */
+static u8 emu_read_byte(void)
+{
+    u8 val = emu.regs[emu.ptr];
+
+    emu.ptr = (emu.ptr + 1) % EMU_NREGS;
+    return val;
+}
+
+
+/*
+ * Ein Byte an den Registerzeiger schreiben, Zeiger weiterschalten.
+ * Nur lesbare und nur rücksetzbare Bits werden wie beim Chip behandelt.
+ */
+static void emu_write_byte(u8 val)
+{
+    u8 reg = emu.ptr;
+    u8 old = emu.regs[reg];
+
+    switch(reg) {
+        case EMU_REG_SECONDS:
+            emu.sec_written = true;
+            /* fall through */
+        case EMU_REG_MINUTES:
+        case EMU_REG_HOURS:
+        case EMU_REG_DAY:
+        case EMU_REG_DATE:
+        case EMU_REG_MONTH:
+        case EMU_REG_YEAR:
+            emu.regs[reg] = val;
+            emu.time_dirty = true;
+            break;
+
+        case EMU_REG_CONTROL:
+            /* Temperaturmessung ist sofort fertig, CONV bleibt nicht stehen */
+            if(val & EMU_BIT_CONV) {
+                emu_update_temp();
+            }
+            emu.regs[reg] = val & ~EMU_BIT_CONV;
+            break;
+
+        case EMU_REG_STATUS:
+            /* OSF, A2F, A1F lassen sich nur löschen, BSY nur lesen */
+            emu.regs[reg] = (old & val & (EMU_BIT_OSF | EMU_BIT_A2F | EMU_BIT_A1F)) |
+                            (val & EMU_BIT_EN32KHZ) | (old & EMU_BIT_BSY);
+            break;
+
+        case EMU_REG_TEMP_MSB:
+        case EMU_REG_TEMP_LSB:
+            break;
+
+        default:
+            emu.regs[reg] = val;
+            break;
+    }
+
+    emu.ptr = (emu.ptr + 1) % EMU_NREGS;
+}
+
+
+/*
+ * Registerzeiger setzen. Werte außerhalb des Registerbereichs laufen über.
+ */
+static void emu_set_ptr(u8 reg)
+{
+    emu.ptr = reg % EMU_NREGS;
+}
+
+
+/*
+ * Beginn eines Buszugriffs: Zeit und Temperatur in die Register übertragen.
+ * Aufruf nur unter emu.lock.
+ */
+static void emu_start(ktime_t now)
+{
+    emu_latch(now);
+    emu_update_temp();
+}
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Busmodell
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Zeitverhalten eines I2C-Busprofils (Zeiten in ns, nach I2C-Spezifikation
+ * UM10204). Ein Byte kostet 9 Takte (8 Datenbits plus ACK).
+ */
+struct emu_timing {
+    const char *name;
+    u32 bit_ns;            /* Dauer eines SCL-Takts */
+    u32 start_ns;          /* tSU;STA + tHD;STA */
+    u32 stop_ns;           /* tSU;STO + tBUF */
+};
+
+static const struct emu_timing emu_timings[] = {
+    { "off",       0,    0,    0    },
+    { "standard",  10000, 8700, 8700 },
+    { "fast",      2500,  1200, 1900 },
+    { "fast-plus", 1000,  520,  760  },
+};
+
+static const struct emu_timing *emu_timing = &emu_timings[0];
+
+
+/*
+ * speed ist zur Laufzeit umstellbar: off, standard (100 kHz),
+ * fast (400 kHz) oder fast-plus (1 MHz).
+ */
+static int emu_speed_set(const char *val, const struct kernel_param *kp)
+{
+    int i;
+
+    for(i = 0; i < ARRAY_SIZE(emu_timings); i++) {
+        if(sysfs_streq(val, emu_timings[i].name)) {
+            WRITE_ONCE(emu_timing, &emu_timings[i]);
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+static int emu_speed_get(char *buffer, const struct kernel_param *kp)
+{
+    return scnprintf(buffer, PAGE_SIZE, "%s\n", READ_ONCE(emu_timing)->name);
+}
+
+static const struct kernel_param_ops emu_speed_ops = {
+    .set = emu_speed_set,
+    .get = emu_speed_get,
+};
+module_param_cb(speed, &emu_speed_ops, NULL, 0644);
+MODULE_PARM_DESC(speed, "Busprofil: off, standard, fast oder fast-plus");
+
+static unsigned int stretch_ns;
+module_param(stretch_ns, uint, 0644);
+MODULE_PARM_DESC(stretch_ns, "Clock-Stretching pro Datenbyte in ns");
+
+static unsigned int nack_permille;
+module_param(nack_permille, uint, 0644);
+MODULE_PARM_DESC(nack_permille, "Anteil der Zugriffe in Promille, deren Adresse mit NACK beantwortet wird");
+
+
+/*
+ * Leitungszeit eines Zugriffs mit starts START-Bedingungen (inkl.
+ * Repeated-START), bytes Bytes auf dem Bus (inkl. Adressbytes) und
+ * einem abschließenden STOP.
+ */
+static u64 emu_wire_ns(unsigned int starts, unsigned int bytes)
+{
+    const struct emu_timing *t = READ_ONCE(emu_timing);
+
+    if(t->bit_ns == 0) {
+        return 0;
+    }
+    return (u64)starts * t->start_ns + (u64)bytes * (9 * t->bit_ns + stretch_ns) + t->stop_ns;
+}
+
+
+/*
+ * Die Leitungszeit verstreichen lassen. Läuft außerhalb von emu.lock,
+ * der I2C-Core hält aber den Adapter gesperrt, so wie ein echter Bus
+ * während der Übertragung belegt ist.
+ */
+static void emu_wire_delay(u64 ns)
+{
+    if(ns == 0) {
+        return;
+    }
+    if(ns < 20 * NSEC_PER_USEC) {
+        ndelay(ns);
+    }
+    else {
+        usleep_range(div_u64(ns, NSEC_PER_USEC), div_u64(ns, NSEC_PER_USEC) + 5);
+    }
+}
+
+
+/*
+ * Entscheidet, ob dieser Zugriff mit einem NACK auf die Adresse endet.
+ */
+static bool emu_inject_nack(void)
+{
+    unsigned int rate = READ_ONCE(nack_permille);
+
+    return rate != 0 && prandom_u32_max(1000) < rate;
+}
+
+
+/* --------------------------------------------------------------------------------------------------------
+    I2C-Adapter
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Reines I2C. Alle Nachrichten eines Aufrufs sehen denselben Zeitstand
+ * (Repeated-START ohne STOP dazwischen).
+ */
+static int emu_master_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+    unsigned long flags;
+    ktime_t now;
+    unsigned int bytes = 0;
+    int i, j;
+
+    if(emu.mode != EMU_MODE_I2C) {
+        return -EOPNOTSUPP;
+    }
+
+    if(emu_inject_nack()) {
+        emu_wire_delay(emu_wire_ns(1, 1));
+        return -ENXIO;
+    }
+
+    spin_lock_irqsave(&emu.lock, flags);
+    now = ktime_get();
+    emu_start(now);
+
+    for(i = 0; i < num; i++) {
+        bytes++;
+        if(msgs[i].addr != addr) {
+            break;
+        }
+        bytes += msgs[i].len;
+
+        if(msgs[i].flags & I2C_M_RD) {
+            for(j = 0; j < msgs[i].len; j++) {
+                msgs[i].buf[j] = emu_read_byte();
+            }
+        }
+        else if(msgs[i].len > 0) {
+            emu_set_ptr(msgs[i].buf[0]);
+            for(j = 1; j < msgs[i].len; j++) {
+                emu_write_byte(msgs[i].buf[j]);
+            }
+        }
+    }
+
+    emu_commit(now);
+    spin_unlock_irqrestore(&emu.lock, flags);
+
+    emu_wire_delay(emu_wire_ns(min(i + 1, num), bytes));
+
+    /* Keine Antwort auf die Adresse: NACK */
+    return (i == 0 && num > 0) ? -ENXIO : i;
+}
+
+
+/*
+ * SMBus: Byte, Byte-Data und I2C-Block.
+ */
+static s32 emu_smbus_xfer(struct i2c_adapter *adap, u16 address, unsigned short flags,
+                          char read_write, u8 command, int size, union i2c_smbus_data *data)
+{
+    unsigned long irqflags;
+    ktime_t now;
+    s32 ret = 0;
+    int i, len;
+    unsigned int starts = 1, bytes = 2;
+
+    if(address != addr || emu_inject_nack()) {
+        emu_wire_delay(emu_wire_ns(1, 1));
+        return -ENXIO;
+    }
+
+    spin_lock_irqsave(&emu.lock, irqflags);
+    now = ktime_get();
+    emu_start(now);
+
+    switch(size) {
+        case I2C_SMBUS_BYTE:
+            if(read_write == I2C_SMBUS_WRITE) {
+                emu_set_ptr(command);
+            }
+            else {
+                data->byte = emu_read_byte();
+            }
+            break;
+
+        case I2C_SMBUS_BYTE_DATA:
+            emu_set_ptr(command);
+            if(read_write == I2C_SMBUS_WRITE) {
+                emu_write_byte(data->byte);
+                bytes = 3;
+            }
+            else {
+                data->byte = emu_read_byte();
+                starts = 2;
+                bytes = 4;
+            }
+            break;
+
+        case I2C_SMBUS_I2C_BLOCK_DATA:
+            if(emu.mode == EMU_MODE_SMBUS_BYTE) {
+                ret = -EOPNOTSUPP;
+                break;
+            }
+            len = min_t(int, data->block[0], I2C_SMBUS_BLOCK_MAX);
+            if(read_write == I2C_SMBUS_WRITE) {
+                bytes = 2 + len;
+            }
+            else {
+                starts = 2;
+                bytes = 3 + len;
+            }
+            emu_set_ptr(command);
+            for(i = 1; i <= len; i++) {
+                if(read_write == I2C_SMBUS_WRITE) {
+                    emu_write_byte(data->block[i]);
+                }
+                else {
+                    data->block[i] = emu_read_byte();
+                }
+            }
+            break;
+
+        default:
+            ret = -EOPNOTSUPP;
+            break;
+    }
+
+    emu_commit(now);
+    spin_unlock_irqrestore(&emu.lock, irqflags);
+
+    if(ret == 0) {
+        emu_wire_delay(emu_wire_ns(starts, bytes));
+    }
+    return ret;
+}
+
+
+static u32 emu_functionality(struct i2c_adapter *adap)
+{
+    switch(emu.mode) {
+        case EMU_MODE_I2C:
+            return I2C_FUNC_I2C | I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA |
+                   I2C_FUNC_SMBUS_I2C_BLOCK;
+        case EMU_MODE_SMBUS_BLOCK:
+            return I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_I2C_BLOCK;
+        default:
+            return I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA;
+    }
+}
+
+
+static const struct i2c_algorithm emu_algorithm = {
+    .master_xfer   = emu_master_xfer,
+    .smbus_xfer    = emu_smbus_xfer,
+    .functionality = emu_functionality,
+};
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Modul
+   --------------------------------------------------------------------------------------------------------*/
+
+
+static int __init ds3231_emu_init(void)
+{
+    struct rtc_time tm;
+    time64_t now_real = ktime_get_real_seconds();
+    int ret;
+
+    if(strcmp(mode, "i2c") == 0) {
+        emu.mode = EMU_MODE_I2C;
+    }
+    else if(strcmp(mode, "smbus-block") == 0) {
+        emu.mode = EMU_MODE_SMBUS_BLOCK;
+    }
+    else if(strcmp(mode, "smbus-byte") == 0) {
+        emu.mode = EMU_MODE_SMBUS_BYTE;
+    }
+    else {
+        printk("DS3231_emu: Unbekannter Modus \"%s\"\n", mode);
+        return -EINVAL;
+    }
+
+    spin_lock_init(&emu.lock);
+
+    /* Uhr mit der Systemzeit starten, auf den darstellbaren Bereich begrenzt */
+    rtc_time64_to_tm(now_real, &tm);
+    if(tm.tm_year + 1900 < EMU_YEAR_MIN || tm.tm_year + 1900 > EMU_YEAR_MAX) {
+        now_real = mktime64(EMU_YEAR_MIN, 1, 1, 0, 0, 0);
+    }
+    emu.base = now_real;
+    emu.stamp = ktime_get();
+    emu.regs[EMU_REG_CONTROL] = EMU_CONTROL_POR;
+    emu.regs[EMU_REG_STATUS] = EMU_STATUS_POR;
+    emu_update_temp();
+
+    ret = irq_sim_init(&emu.irq_sim, 1);
+    if(ret < 0) {
+        printk("DS3231_emu: Simulierter Interrupt konnte nicht angelegt werden (error = %d)\n", ret);
+        return ret;
+    }
+    emu.irq = irq_sim_irqnum(&emu.irq_sim, 0);
+
+    hrtimer_init(&emu.tick, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    emu.tick.function = emu_tick_fn;
+    hrtimer_start(&emu.tick, emu_next_tick(emu.stamp), HRTIMER_MODE_ABS);
+
+    emu.adapter.owner = THIS_MODULE;
+    emu.adapter.class = I2C_CLASS_HWMON;
+    emu.adapter.algo = &emu_algorithm;
+    emu.adapter.nr = bus_nr;
+    strlcpy(emu.adapter.name, "DS3231 emulator", sizeof(emu.adapter.name));
+
+    if(bus_nr < 0) {
+        ret = i2c_add_adapter(&emu.adapter);
+    }
+    else {
+        ret = i2c_add_numbered_adapter(&emu.adapter);
+    }
+    if(ret < 0) {
+        printk("DS3231_emu: Adapter konnte nicht registriert werden (error = %d)\n", ret);
+        goto cleanup_irq;
+    }
+
+    printk("DS3231_emu: Emulierter DS3231 an i2c-%d, Adresse 0x%02x, Modus %s, Interrupt %d\n",
+           emu.adapter.nr, addr, mode, emu.irq);
+
+    if(client) {
+        struct i2c_board_info info = {
+            I2C_BOARD_INFO("ds3231_drv", 0)
+        };
+
+        info.addr = addr;
+        info.irq = emu.irq;
+        emu.client = i2c_new_client_device(&emu.adapter, &info);
+        if(IS_ERR(emu.client)) {
+            ret = PTR_ERR(emu.client);
+            emu.client = NULL;
+            printk("DS3231_emu: I2C Client konnte nicht angelegt werden (error = %d)\n", ret);
+            i2c_del_adapter(&emu.adapter);
+            goto cleanup_irq;
+        }
+    }
+    return 0;
+
+cleanup_irq:
+    hrtimer_cancel(&emu.tick);
+    irq_sim_fini(&emu.irq_sim);
+    return ret;
+}
+module_init(ds3231_emu_init);
+
+
+static void __exit ds3231_emu_exit(void)
+{
+    if(emu.client != NULL) {
+        i2c_unregister_device(emu.client);
+    }
+    i2c_del_adapter(&emu.adapter);
+    hrtimer_cancel(&emu.tick);
+    irq_sim_fini(&emu.irq_sim);
+}
+module_exit(ds3231_emu_exit);
+
+
+MODULE_AUTHOR("Pascal Otto <uk058821@student.uni-kassel.de>");
+MODULE_DESCRIPTION("DS3231 - Software-Emulator mit virtuellem I2C-Adapter");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,88 @@
+/*
+ * ioctl-Befehle des DS3231-Treibers über die RTC-ioctls hinaus.
+ *
+ * Der Header wird vom Treiber und von Programmen im Userspace
+ * eingebunden und verwendet daher nur die UAPI-Typen.
+ */
+#ifndef _DS3231_IOCTL_H
+#define _DS3231_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define DS3231_IOCTL_MAGIC      'D'
+
+/*
+ * Stellen mit ns-Auflösung.
+ *
+ * rtc_sec/rtc_nsec ist die RTC-Zeit (UTC), die zum CLOCK_REALTIME-Zeitpunkt
+ * ref_sec/ref_nsec gelten soll, ref = 0 steht für den Zeitpunkt des
+ * Aufrufs. Der Treiber schreibt beim nächsten vollen Sekundenwechsel
+ * dieser Zeit und liefert in error_ns die gemessene Abweichung des
+ * Schreibzugriffs vom Sollzeitpunkt, in uncertainty_ns die halbe Dauer
+ * des Zugriffs zurück.
+ */
+struct ds3231_set_time {
+    __s64 rtc_sec;
+    __s64 rtc_nsec;
+    __s64 ref_sec;
+    __s64 ref_nsec;
+    __s64 error_ns;          /* Ausgabe */
+    __s64 uncertainty_ns;    /* Ausgabe */
+};
+
+#define DS3231_SET_TIME_TS      _IOWR(DS3231_IOCTL_MAGIC, 0x01, struct ds3231_set_time)
+
+/*
+ * Messung des Versatzes zwischen RTC und Systemzeit, angelehnt an
+ * PTP_SYS_OFFSET_EXTENDED.
+ *
+ * Der Treiber liest die Zeitregister n_samples mal direkt von der
+ * Hardware (ohne Cache). Jeder Lesezugriff wird im Kernel unmittelbar
+ * vorher und nachher mit CLOCK_REALTIME und CLOCK_MONOTONIC_RAW
+ * eingerahmt. Der Sekundenwechsel der RTC liegt irgendwo zwischen
+ * real_pre und real_post, best ist der Index der Probe mit dem engsten
+ * Rahmen. Schlägt ein Lesezugriff fehl, liefert der Treiber die bis dahin
+ * gesammelten Proben und setzt n_samples auf deren Anzahl, ein Fehler
+ * kommt nur, wenn keine einzige Probe gelang.
+ */
+#define DS3231_MAX_SAMPLES      25
+
+struct ds3231_timestamp {
+    __s64 sec;
+    __s64 nsec;
+};
+
+struct ds3231_offset_sample {
+    struct ds3231_timestamp real_pre;
+    struct ds3231_timestamp raw_pre;
+    __s64 rtc_sec;           /* RTC-Zeit in Sekunden seit 1970 (UTC) */
+    struct ds3231_timestamp raw_post;
+    struct ds3231_timestamp real_post;
+};
+
+struct ds3231_sys_offset {
+    __u32 n_samples;         /* Eingabe: 1 - DS3231_MAX_SAMPLES, Ausgabe: gelieferte Proben */
+    __u32 best;              /* Ausgabe: Index der Probe mit dem engsten Rahmen */
+    struct ds3231_offset_sample ts[DS3231_MAX_SAMPLES];
+};
+
+#define DS3231_SYS_OFFSET       _IOWR(DS3231_IOCTL_MAGIC, 0x02, struct ds3231_sys_offset)
+
+/*
+ * Ausgabeformat von read() auf /dev/ds3231, gilt pro geöffneter Datei.
+ * Die Binärformate werden nur vollständig geliefert, ein zu kleiner
+ * Buffer ergibt EINVAL.
+ */
+enum ds3231_read_mode {
+    DS3231_MODE_TEXT,        /* "DD.MM.YYYY HH:MM:SS\n" (Voreinstellung) */
+    DS3231_MODE_ISO8601,     /* "YYYY-MM-DDTHH:MM:SS\n" */
+    DS3231_MODE_RTC_TIME,    /* struct rtc_time */
+    DS3231_MODE_TIME64,      /* Sekunden seit 1970 als __le64 */
+    DS3231_MODE_MAX,
+};
+
+#define DS3231_SET_READ_MODE    _IOW(DS3231_IOCTL_MAGIC, 0x03, __u32)
+#define DS3231_GET_READ_MODE    _IOR(DS3231_IOCTL_MAGIC, 0x04, __u32)
+
+#endif /* _DS3231_IOCTL_H */
@@ -0,0 +1,789 @@
+/*
+ * KUnit-Tests und Microbenchmarks für ds3231.c.
+ *
+ * Die Datei wird bei CONFIG_DS3231_KUNIT_TEST am Ende von ds3231.c
+ * eingebunden, damit die statischen Funktionen erreichbar sind. Die Suite
+ * "ds3231_codec" prüft die Umwandlung der Zeitregister, ds3231_check_date()
+ * und das Parsen von write() ohne Bus. Die Suite "ds3231_emu" läuft gegen
+ * den Adapter des Software-Emulators (ds3231_emu.c), der dafür ebenfalls
+ * fest in den Kernel gebaut sein muss. Die Ergebnisse stehen als TAP im
+ * Kernel-Log.
+ *
+ * Die Microbenchmarks geben ns/op aus und schlagen fehl, wenn die
+ * Grenzwerte unten überschritten werden. Die Grenzwerte für Buszugriffe
+ * gelten für den Emulator ohne Leitungszeit (speed=off, Voreinstellung).
+ */
+#include <kunit/test.h>
+#include <linux/version.h>
+
+
+/* Grenzwerte der Microbenchmarks in ns/op */
+#define DS3231_BENCH_CODEC_NS   1000
+#define DS3231_BENCH_READ_NS    50000
+#define DS3231_BENCH_WRITE_NS   100000
+
+/* Durchläufe der Microbenchmarks */
+#define DS3231_BENCH_CODEC_LOOPS  100000
+#define DS3231_BENCH_BUS_LOOPS    1000
+
+/* Name des Adapters aus ds3231_emu.c */
+#define DS3231_TEST_EMU_NAME    "DS3231 emulator"
+
+
+/*
+ * Datum aus Einzelwerten zusammensetzen (Jahr vierstellig, Monat 1 - 12).
+ */
+static struct rtc_time ds3231_test_tm(int year, int mon, int mday, int hour, int min, int sec)
+{
+    struct rtc_time tm = {
+        .tm_year = year - 1900,
+        .tm_mon  = mon - 1,
+        .tm_mday = mday,
+        .tm_hour = hour,
+        .tm_min  = min,
+        .tm_sec  = sec,
+    };
+
+    return tm;
+}
+
+
+/*
+ * Zwei Datumsangaben in den Feldern vergleichen, die der DS3231 speichert.
+ */
+static void ds3231_test_expect_tm(struct kunit *test, const struct rtc_time *got, const struct rtc_time *want)
+{
+    KUNIT_EXPECT_EQ(test, got->tm_year, want->tm_year);
+    KUNIT_EXPECT_EQ(test, got->tm_mon, want->tm_mon);
+    KUNIT_EXPECT_EQ(test, got->tm_mday, want->tm_mday);
+    KUNIT_EXPECT_EQ(test, got->tm_hour, want->tm_hour);
+    KUNIT_EXPECT_EQ(test, got->tm_min, want->tm_min);
+    KUNIT_EXPECT_EQ(test, got->tm_sec, want->tm_sec);
+}
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Registerformat ohne Bus
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Zustand für ds3231_date_to_regs() ohne Buszugriff: Stundenformat im
+ * Schatten als gültig markiert.
+ */
+static struct ds3231 *ds3231_test_codec_ds(struct kunit *test, u8 hour_mode)
+{
+    struct ds3231 *ds;
+
+    ds = kunit_kzalloc(test, sizeof(*ds), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ds);
+    ds->shadow.valid = true;
+    ds->shadow.hour_mode = hour_mode;
+    return ds;
+}
+
+
+static void ds3231_test_hour_24h(struct kunit *test)
+{
+    int hour;
+    u8 reg;
+
+    for(hour = 0; hour < 24; hour++) {
+        reg = ds3231_hour_to_reg(0, hour);
+        KUNIT_EXPECT_EQ(test, reg, (u8)bin2bcd(hour));
+        KUNIT_EXPECT_EQ(test, ds3231_hour_from_reg(reg), hour);
+    }
+}
+
+
+static void ds3231_test_hour_12h(struct kunit *test)
+{
+    static const struct {
+        int hour;
+        u8 reg;
+    } cases[] = {
+        {  0, 0x52 },   /* 12 AM */
+        {  1, 0x41 },
+        { 11, 0x51 },
+        { 12, 0x72 },   /* 12 PM */
+        { 13, 0x61 },
+        { 23, 0x71 },
+    };
+    int i, hour;
+    u8 reg;
+
+    for(i = 0; i < ARRAY_SIZE(cases); i++) {
+        KUNIT_EXPECT_EQ(test, ds3231_hour_to_reg(DS3231_BIT_12H, cases[i].hour), cases[i].reg);
+        KUNIT_EXPECT_EQ(test, ds3231_hour_from_reg(cases[i].reg), cases[i].hour);
+    }
+
+    for(hour = 0; hour < 24; hour++) {
+        reg = ds3231_hour_to_reg(DS3231_BIT_12H, hour);
+        KUNIT_EXPECT_TRUE(test, reg & DS3231_BIT_12H);
+        KUNIT_EXPECT_EQ(test, !!(reg & DS3231_BIT_nAM), hour >= 12);
+        KUNIT_EXPECT_EQ(test, ds3231_hour_from_reg(reg), hour);
+    }
+}
+
+
+/*
+ * Datum in Register und zurück wandeln und die Register einzeln prüfen.
+ */
+static void ds3231_test_codec_one(struct kunit *test, struct ds3231 *ds, const struct rtc_time *tm)
+{
+    struct rtc_time back, wday;
+    u8 regs[7];
+
+    memset(regs, 0, sizeof(regs));
+    KUNIT_ASSERT_EQ(test, ds3231_date_to_regs(ds, tm, regs), 0);
+
+    rtc_time64_to_tm(rtc_tm_to_time64(tm), &wday);
+    KUNIT_EXPECT_EQ(test, regs[DS3231_REG_SECONDS], (u8)bin2bcd(tm->tm_sec));
+    KUNIT_EXPECT_EQ(test, regs[DS3231_REG_MINUTES], (u8)bin2bcd(tm->tm_min));
+    KUNIT_EXPECT_EQ(test, regs[DS3231_REG_HOURS], ds3231_hour_to_reg(ds->shadow.hour_mode, tm->tm_hour));
+    KUNIT_EXPECT_EQ(test, regs[DS3231_REG_DAY], (u8)bin2bcd(wday.tm_wday + 1));
+    KUNIT_EXPECT_EQ(test, regs[DS3231_REG_DATE], (u8)bin2bcd(tm->tm_mday));
+    KUNIT_EXPECT_EQ(test, (u8)(regs[DS3231_REG_MONTH] & ~DS3231_BIT_CENTURY), (u8)bin2bcd(tm->tm_mon + 1));
+    KUNIT_EXPECT_EQ(test, !!(regs[DS3231_REG_MONTH] & DS3231_BIT_CENTURY), tm->tm_year >= 200);
+    KUNIT_EXPECT_EQ(test, regs[DS3231_REG_YEAR], (u8)bin2bcd(tm->tm_year % 100));
+
+    memset(&back, 0, sizeof(back));
+    KUNIT_ASSERT_EQ(test, ds3231_regs_to_date(regs, &back), 0);
+    ds3231_test_expect_tm(test, &back, tm);
+}
+
+
+/*
+ * Alle Monate mit erstem und letztem Tag in beiden Stundenformaten, über
+ * Schaltjahre (2000, 2024), Nicht-Schaltjahre (2023, 2100) und die
+ * Grenzen des Century-Bits.
+ */
+static void ds3231_test_codec_months(struct kunit *test)
+{
+    static const int years[] = { 2000, 2023, 2024, 2099, 2100, 2199 };
+    static const u8 modes[] = { 0, DS3231_BIT_12H };
+    struct rtc_time tm;
+    struct ds3231 *ds;
+    int m, y, mon, last;
+
+    for(m = 0; m < ARRAY_SIZE(modes); m++) {
+        ds = ds3231_test_codec_ds(test, modes[m]);
+        for(y = 0; y < ARRAY_SIZE(years); y++) {
+            for(mon = 1; mon <= 12; mon++) {
+                last = rtc_month_days(mon - 1, years[y]);
+
+                tm = ds3231_test_tm(years[y], mon, 1, 0, 0, 0);
+                ds3231_test_codec_one(test, ds, &tm);
+                tm = ds3231_test_tm(years[y], mon, last, 23, 59, 59);
+                ds3231_test_codec_one(test, ds, &tm);
+                tm = ds3231_test_tm(years[y], mon, 15, 12, 30, 45);
+                ds3231_test_codec_one(test, ds, &tm);
+            }
+        }
+    }
+}
+
+
+/*
+ * Century-Bit: 2000 - 2099 ohne, 2100 - 2199 mit.
+ */
+static void ds3231_test_codec_century(struct kunit *test)
+{
+    u8 regs[7] = { 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x00 };
+    struct rtc_time tm;
+
+    KUNIT_ASSERT_EQ(test, ds3231_regs_to_date(regs, &tm), 0);
+    KUNIT_EXPECT_EQ(test, tm.tm_year + 1900, 2000);
+
+    regs[DS3231_REG_MONTH] = 0x12;
+    regs[DS3231_REG_DATE] = 0x31;
+    regs[DS3231_REG_YEAR] = 0x99;
+    KUNIT_ASSERT_EQ(test, ds3231_regs_to_date(regs, &tm), 0);
+    KUNIT_EXPECT_EQ(test, tm.tm_year + 1900, 2099);
+    KUNIT_EXPECT_EQ(test, tm.tm_mon, 11);
+
+    regs[DS3231_REG_MONTH] = DS3231_BIT_CENTURY | 0x01;
+    regs[DS3231_REG_DATE] = 0x01;
+    regs[DS3231_REG_YEAR] = 0x00;
+    KUNIT_ASSERT_EQ(test, ds3231_regs_to_date(regs, &tm), 0);
+    KUNIT_EXPECT_EQ(test, tm.tm_year + 1900, 2100);
+    KUNIT_EXPECT_EQ(test, tm.tm_mon, 0);
+
+    regs[DS3231_REG_MONTH] = DS3231_BIT_CENTURY | 0x12;
+    regs[DS3231_REG_YEAR] = 0x99;
+    KUNIT_ASSERT_EQ(test, ds3231_regs_to_date(regs, &tm), 0);
+    KUNIT_EXPECT_EQ(test, tm.tm_year + 1900, 2199);
+    KUNIT_EXPECT_EQ(test, tm.tm_mon, 11);
+}
+
+
+static void ds3231_test_check_date(struct kunit *test)
+{
+    static const struct {
+        int year, mon, mday, hour, min, sec;
+        bool valid;
+    } cases[] = {
+        { 2000,  1,  1,  0,  0,  0, true  },
+        { 2199, 12, 31, 23, 59, 59, true  },
+        { 1999, 12, 31, 23, 59, 59, false },
+        { 2200,  1,  1,  0,  0,  0, false },
+        { 2000,  2, 29, 12,  0,  0, true  },    /* durch 400 teilbar */
+        { 2024,  2, 29, 12,  0,  0, true  },
+        { 2023,  2, 29, 12,  0,  0, false },
+        { 2100,  2, 29, 12,  0,  0, false },    /* durch 100 teilbar */
+        { 2023,  4, 31, 12,  0,  0, false },
+        { 2023,  4,  0, 12,  0,  0, false },
+        { 2023,  0,  1, 12,  0,  0, false },
+        { 2023, 13,  1, 12,  0,  0, false },
+        { 2023,  6,  1, 24,  0,  0, false },
+        { 2023,  6,  1, 12, 60,  0, false },
+        { 2023,  6,  1, 12,  0, 60, false },
+        { 2023,  6,  1, -1,  0,  0, false },
+    };
+    static const int years[] = { 2000, 2023, 2024, 2100, 2199 };
+    struct rtc_time tm;
+    int i, y, mon, last;
+
+    for(i = 0; i < ARRAY_SIZE(cases); i++) {
+        tm = ds3231_test_tm(cases[i].year, cases[i].mon, cases[i].mday,
+                            cases[i].hour, cases[i].min, cases[i].sec);
+        KUNIT_EXPECT_EQ(test, ds3231_check_date(&tm), cases[i].valid ? 0 : (u32)-EINVAL);
+    }
+
+    /* Letzter Tag jedes Monats gültig, der folgende nicht */
+    for(y = 0; y < ARRAY_SIZE(years); y++) {
+        for(mon = 1; mon <= 12; mon++) {
+            last = rtc_month_days(mon - 1, years[y]);
+            tm = ds3231_test_tm(years[y], mon, last, 0, 0, 0);
+            KUNIT_EXPECT_EQ(test, ds3231_check_date(&tm), 0u);
+            tm.tm_mday++;
+            KUNIT_EXPECT_EQ(test, ds3231_check_date(&tm), (u32)-EINVAL);
+        }
+    }
+}
+
+
+/*
+ * Parsen von write(): genau 19 Zeichen, optional ein '\n' als 20. Byte.
+ */
+static void ds3231_test_parse_date(struct kunit *test)
+{
+    static const struct {
+        const char *str;
+        s32 ret;
+    } cases[] = {
+        { "2024-02-29 12:34:56",     0       },
+        { "2024-02-29 12:34:56\n",   0       },
+        { "2024-02-29 12:34:56X",    -EINVAL },     /* 20. Byte kein '\n' */
+        { "2024-02-29 12:34:56 ",    -EINVAL },
+        { "2024-02-29 12:34:56\n\n", -EINVAL },     /* zu lang */
+        { "2024-02-29 12:34:5",      -EINVAL },     /* zu kurz */
+        { "2024/02/29 12:34:56",     -EINVAL },
+        { "2024-02-29T12:34:56",     -EINVAL },
+        { "20a4-02-29 12:34:56",     -EINVAL },
+        { "2023-02-29 12:34:56",     -EINVAL },     /* kein Schaltjahr */
+        { "2024-13-01 00:00:00",     -EINVAL },
+        { "1999-12-31 23:59:59",     -EINVAL },
+    };
+    struct rtc_time tm, want;
+    int i;
+
+    for(i = 0; i < ARRAY_SIZE(cases); i++) {
+        KUNIT_EXPECT_EQ_MSG(test, ds3231_parse_date(cases[i].str, strlen(cases[i].str), &tm),
+                            cases[i].ret, "Eingabe \"%s\"", cases[i].str);
+    }
+
+    want = ds3231_test_tm(2024, 2, 29, 12, 34, 56);
+    KUNIT_ASSERT_EQ(test, ds3231_parse_date("2024-02-29 12:34:56\n", 20, &tm), 0);
+    ds3231_test_expect_tm(test, &tm, &want);
+}
+
+
+/*
+ * Umwandlung in beide Richtungen, wie sie jeder Lese- bzw.
+ * Schreibzugriff ohne die Buszeit kostet.
+ */
+static void ds3231_test_bench_codec(struct kunit *test)
+{
+    struct ds3231 *ds = ds3231_test_codec_ds(test, 0);
+    struct rtc_time tm = ds3231_test_tm(2024, 2, 29, 12, 34, 56);
+    u8 regs[7];
+    ktime_t start;
+    u64 ns;
+    int i;
+
+    start = ktime_get();
+    for(i = 0; i < DS3231_BENCH_CODEC_LOOPS; i++) {
+        ds3231_date_to_regs(ds, &tm, regs);
+        ds3231_regs_to_date(regs, &tm);
+        barrier();
+    }
+    ns = div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)), DS3231_BENCH_CODEC_LOOPS);
+
+    kunit_info(test, "codec: %llu ns/op\n", ns);
+    KUNIT_EXPECT_LE(test, ns, (u64)DS3231_BENCH_CODEC_NS);
+}
+
+
+static struct kunit_case ds3231_codec_cases[] = {
+    KUNIT_CASE(ds3231_test_hour_24h),
+    KUNIT_CASE(ds3231_test_hour_12h),
+    KUNIT_CASE(ds3231_test_codec_months),
+    KUNIT_CASE(ds3231_test_codec_century),
+    KUNIT_CASE(ds3231_test_check_date),
+    KUNIT_CASE(ds3231_test_parse_date),
+    KUNIT_CASE(ds3231_test_bench_codec),
+    {}
+};
+
+static struct kunit_suite ds3231_codec_suite = {
+    .name = "ds3231_codec",
+    .test_cases = ds3231_codec_cases,
+};
+
+
+/* --------------------------------------------------------------------------------------------------------
+    Gegen den emulierten Bus
+   --------------------------------------------------------------------------------------------------------*/
+
+
+/*
+ * Gemeinsamer Zustand der Emulator-Tests. Hängt bereits ein DS3231 am
+ * Emulator (z.B. ds3231_emu.client=1), wird dieser verwendet, sonst legt
+ * der Test einen eigenen Client an.
+ */
+struct ds3231_test_emu {
+    struct i2c_adapter *adapter;
+    struct i2c_client *client;     /* Vom Test angelegt, sonst NULL */
+    struct ds3231 *ds;             /* Mit eigener Referenz */
+    unsigned int cache_ms;         /* Modulparameter vor dem Test */
+    unsigned int calib_s;
+};
+
+
+static int ds3231_test_find_emu(struct device *dev, void *data)
+{
+    struct i2c_adapter *adapter = i2c_verify_adapter(dev);
+
+    if(adapter == NULL || strcmp(adapter->name, DS3231_TEST_EMU_NAME) != 0) {
+        return 0;
+    }
+    *(struct i2c_adapter **)data = adapter;
+    return 1;
+}
+
+
+/*
+ * Den am Adapter gebundenen DS3231 suchen und eine Referenz nehmen. Der
+ * Treiber bindet asynchron, vorher wait_for_device_probe() aufrufen.
+ */
+static struct ds3231 *ds3231_test_get_ds(struct i2c_adapter *adapter)
+{
+    struct ds3231 *ds, *found = NULL;
+
+    mutex_lock(&ds3231_devices_lock);
+    list_for_each_entry(ds, &ds3231_devices, node) {
+        if(ds->client->adapter == adapter) {
+            kref_get(&ds->kref);
+            found = ds;
+            break;
+        }
+    }
+    mutex_unlock(&ds3231_devices_lock);
+    return found;
+}
+
+
+static int ds3231_test_emu_init(struct kunit *test)
+{
+    struct i2c_board_info info = {
+        I2C_BOARD_INFO("ds3231_drv", 0x68)
+    };
+    struct ds3231_test_emu *emu;
+    struct i2c_adapter *found = NULL;
+    int ret;
+
+    emu = kunit_kzalloc(test, sizeof(*emu), GFP_KERNEL);
+    if(emu == NULL) {
+        return -ENOMEM;
+    }
+    test->priv = emu;
+    emu->cache_ms = READ_ONCE(cache_ms);
+    emu->calib_s = READ_ONCE(calib_s);
+
+    i2c_for_each_dev(&found, ds3231_test_find_emu);
+    if(found == NULL) {
+        kunit_err(test, "Adapter \"%s\" nicht gefunden\n", DS3231_TEST_EMU_NAME);
+        return -ENODEV;
+    }
+    emu->adapter = i2c_get_adapter(i2c_adapter_id(found));
+    if(emu->adapter == NULL) {
+        return -ENODEV;
+    }
+
+    /* Bereits gebundenen DS3231 am Emulator suchen */
+    wait_for_device_probe();
+    emu->ds = ds3231_test_get_ds(emu->adapter);
+
+    if(emu->ds == NULL) {
+        emu->client = i2c_new_client_device(emu->adapter, &info);
+        if(IS_ERR(emu->client)) {
+            ret = PTR_ERR(emu->client);
+            emu->client = NULL;
+            kunit_err(test, "I2C Client konnte nicht angelegt werden (error = %d)\n", ret);
+            return ret;
+        }
+        wait_for_device_probe();
+        emu->ds = ds3231_test_get_ds(emu->adapter);
+        if(emu->ds == NULL) {
+            kunit_err(test, "Treiber nicht an den Client gebunden\n");
+            return -ENODEV;
+        }
+    }
+
+    ret = ds3231_wait_ready(emu->ds);
+    if(ret < 0) {
+        kunit_err(test, "Initialisierung fehlgeschlagen (error = %d)\n", ret);
+    }
+    return ret;
+}
+
+
+static void ds3231_test_emu_exit(struct kunit *test)
+{
+    struct ds3231_test_emu *emu = test->priv;
+    struct rtc_time now;
+
+    if(emu == NULL) {
+        return;
+    }
+
+    /* Von Tests umgestellte Modulparameter zurücksetzen */
+    WRITE_ONCE(cache_ms, emu->cache_ms);
+    WRITE_ONCE(calib_s, emu->calib_s);
+
+    /* Emulierte Uhr wieder auf die Systemzeit stellen */
+    if(emu->ds != NULL) {
+        rtc_time64_to_tm(ktime_get_real_seconds(), &now);
+        if(ds3231_check_date(&now) == 0) {
+            ds3231_write_date(emu->ds, &now);
+        }
+        kref_put(&emu->ds->kref, ds3231_release);
+    }
+    if(emu->client != NULL) {
+        i2c_unregister_device(emu->client);
+    }
+    if(emu->adapter != NULL) {
+        i2c_put_adapter(emu->adapter);
+    }
+}
+
+
+/*
+ * Zeitregister direkt vom Bus lesen, am Cache vorbei.
+ */
+static void ds3231_test_read_regs(struct kunit *test, struct ds3231 *ds, u8 *regs)
+{
+    s32 ret;
+
+    ds3231_lock(ds);
+    ret = ds3231_read_block_data(ds, DS3231_REG_SECONDS, 7, regs);
+    mutex_unlock(&ds->lock);
+    /* Lesen liefert die Anzahl gelesener Bytes */
+    KUNIT_ASSERT_EQ(test, ret, 7);
+}
+
+
+/*
+ * Schreiben und Zurücklesen über den Treiber und direkt aus den Registern.
+ * Zwischen beiden Zugriffen darf höchstens ein Sekundenwechsel liegen.
+ */
+static void ds3231_test_emu_roundtrip_one(struct kunit *test, struct ds3231 *ds, const struct rtc_time *tm)
+{
+    struct rtc_time got;
+    time64_t want = rtc_tm_to_time64(tm);
+    s64 diff;
+    u8 regs[7];
+
+    KUNIT_ASSERT_EQ(test, ds3231_write_date(ds, tm), 0);
+
+    memset(&got, 0, sizeof(got));
+    KUNIT_ASSERT_EQ(test, ds3231_read_date(ds, &got), 0);
+    diff = rtc_tm_to_time64(&got) - want;
+    KUNIT_EXPECT_TRUE_MSG(test, diff >= 0 && diff <= 1, "Abweichung %lld s", diff);
+
+    ds3231_test_read_regs(test, ds, regs);
+    KUNIT_ASSERT_EQ(test, ds3231_regs_to_date(regs, &got), 0);
+    diff = rtc_tm_to_time64(&got) - want;
+    KUNIT_EXPECT_TRUE_MSG(test, diff >= 0 && diff <= 1, "Abweichung %lld s", diff);
+    KUNIT_EXPECT_EQ(test, !!(regs[DS3231_REG_MONTH] & DS3231_BIT_CENTURY), got.tm_year >= 200);
+}
+
+
+static void ds3231_test_emu_roundtrip(struct kunit *test)
+{
+    struct ds3231_test_emu *emu = test->priv;
+    struct rtc_time tm;
+    int mon;
+
+    for(mon = 1; mon <= 12; mon++) {
+        tm = ds3231_test_tm(2024, mon, rtc_month_days(mon - 1, 2024), 12, 0, 0);
+        ds3231_test_emu_roundtrip_one(test, emu->ds, &tm);
+    }
+
+    tm = ds3231_test_tm(2000, 1, 1, 0, 0, 0);
+    ds3231_test_emu_roundtrip_one(test, emu->ds, &tm);
+    tm = ds3231_test_tm(2099, 12, 31, 23, 59, 0);
+    ds3231_test_emu_roundtrip_one(test, emu->ds, &tm);
+    tm = ds3231_test_tm(2100, 3, 1, 0, 0, 0);
+    ds3231_test_emu_roundtrip_one(test, emu->ds, &tm);
+    tm = ds3231_test_tm(2199, 12, 31, 11, 0, 0);
+    ds3231_test_emu_roundtrip_one(test, emu->ds, &tm);
+}
+
+
+/*
+ * Der emulierte Chip läuft von 2099 nach 2100 und setzt das Century-Bit.
+ */
+static void ds3231_test_emu_century(struct kunit *test)
+{
+    struct ds3231_test_emu *emu = test->priv;
+    struct rtc_time tm = ds3231_test_tm(2099, 12, 31, 23, 59, 59);
+    u8 regs[7];
+
+    KUNIT_ASSERT_EQ(test, ds3231_write_date(emu->ds, &tm), 0);
+    msleep(1100);
+
+    ds3231_test_read_regs(test, emu->ds, regs);
+    KUNIT_EXPECT_TRUE(test, regs[DS3231_REG_MONTH] & DS3231_BIT_CENTURY);
+    KUNIT_EXPECT_EQ(test, regs[DS3231_REG_YEAR], (u8)0x00);
+    KUNIT_EXPECT_EQ(test, (u8)(regs[DS3231_REG_MONTH] & ~DS3231_BIT_CENTURY), (u8)0x01);
+    KUNIT_EXPECT_EQ(test, regs[DS3231_REG_DATE], (u8)0x01);
+    KUNIT_ASSERT_EQ(test, ds3231_regs_to_date(regs, &tm), 0);
+    KUNIT_EXPECT_EQ(test, tm.tm_year + 1900, 2100);
+}
+
+
+/*
+ * Stundenformat des Chips umstellen. Der Schatten wird verworfen, damit
+ * ds3231_date_to_regs() das Format neu liest.
+ */
+static void ds3231_test_emu_hour_mode(struct kunit *test, struct ds3231 *ds, u8 mode)
+{
+    u8 hours;
+    s32 rd, wr = 0;
+
+    ds3231_lock(ds);
+    rd = ds3231_read_block_data(ds, DS3231_REG_HOURS, 1, &hours);
+    if(rd == 1) {
+        hours = ds3231_hour_to_reg(mode, ds3231_hour_from_reg(hours));
+        wr = ds3231_write_block_data(ds, DS3231_REG_HOURS, 1, &hours);
+    }
+    ds->shadow.valid = false;
+    ds3231_cache_invalidate(ds);
+    mutex_unlock(&ds->lock);
+    /* Lesen liefert die Anzahl Bytes, Schreiben 0 */
+    KUNIT_ASSERT_EQ(test, rd, 1);
+    KUNIT_ASSERT_EQ(test, wr, 0);
+}
+
+
+/*
+ * Im 12H-Format schreibt der Treiber AM/PM und liest es wieder zurück.
+ */
+static void ds3231_test_emu_12h(struct kunit *test)
+{
+    static const int hours[] = { 0, 1, 11, 12, 13, 23 };
+    struct ds3231_test_emu *emu = test->priv;
+    struct rtc_time tm, got;
+    u8 regs[7];
+    int i;
+
+    ds3231_test_emu_hour_mode(test, emu->ds, DS3231_BIT_12H);
+
+    for(i = 0; i < ARRAY_SIZE(hours); i++) {
+        tm = ds3231_test_tm(2024, 6, 15, hours[i], 30, 0);
+        KUNIT_ASSERT_EQ(test, ds3231_write_date(emu->ds, &tm), 0);
+
+        ds3231_test_read_regs(test, emu->ds, regs);
+        KUNIT_EXPECT_EQ(test, regs[DS3231_REG_HOURS], ds3231_hour_to_reg(DS3231_BIT_12H, hours[i]));
+
+        memset(&got, 0, sizeof(got));
+        KUNIT_ASSERT_EQ(test, ds3231_read_date(emu->ds, &got), 0);
+        KUNIT_EXPECT_EQ(test, got.tm_hour, hours[i]);
+    }
+
+    ds3231_test_emu_hour_mode(test, emu->ds, 0);
+}
+
+
+/*
+ * Bis zum CLOCK_MONOTONIC_RAW-Zeitpunkt when schlafen.
+ */
+static void ds3231_test_sleep_until_raw(ktime_t when)
+{
+    s64 left = ktime_to_ns(ktime_sub(when, ktime_get_raw()));
+
+    if(left > 0) {
+        usleep_range(div_s64(left, NSEC_PER_USEC), div_s64(left, NSEC_PER_USEC) + 100);
+    }
+}
+
+
+/*
+ * Mit kalibrierter Phase schalten Cache-Treffer genau am Sekundenwechsel
+ * der RTC weiter: DS3231_TEST_EDGE_MS davor noch die alte, danach schon
+ * die neue Sekunde, übereinstimmend mit den Registern des Chips.
+ */
+#define DS3231_TEST_EDGE_MS     10
+
+static void ds3231_test_emu_phase_rollover(struct kunit *test)
+{
+    struct ds3231_test_emu *emu = test->priv;
+    struct ds3231 *ds = emu->ds;
+    struct rtc_time tm = ds3231_test_tm(2024, 6, 15, 12, 0, 0);
+    struct ds3231_phase phase;
+    ktime_t edge;
+    time64_t want;
+    s64 k;
+    u8 regs[7];
+    int i;
+
+    KUNIT_ASSERT_EQ(test, ds3231_write_date(ds, &tm), 0);
+
+    /* Cache und Phase für die Dauer des Tests einschalten */
+    WRITE_ONCE(cache_ms, 10 * MSEC_PER_SEC);
+    WRITE_ONCE(calib_s, 3600);
+    KUNIT_ASSERT_EQ(test, ds3231_calibrate(ds), 0);
+
+    ds3231_lock(ds);
+    phase = ds->phase;
+    mutex_unlock(&ds->lock);
+    KUNIT_ASSERT_TRUE(test, phase.valid);
+    kunit_info(test, "Phase: Unsicherheit %lld ns, %u Proben\n", phase.uncertainty, phase.probes);
+
+    /* Cache-Basis von der Hardware */
+    KUNIT_ASSERT_EQ(test, ds3231_read_date(ds, &tm), 0);
+
+    /* Erster Sekundenwechsel mit genug Vorlauf */
+    k = div64_s64(ktime_to_ns(ktime_sub(ktime_get_raw(), phase.edge)), phase.period) + 1;
+    if(ktime_to_ns(ktime_sub(ktime_add_ns(phase.edge, k * phase.period), ktime_get_raw())) <
+       5 * DS3231_TEST_EDGE_MS * NSEC_PER_MSEC) {
+        k++;
+    }
+
+    for(i = 0; i < 2; i++, k++) {
+        edge = ktime_add_ns(phase.edge, k * phase.period);
+        want = phase.edge_sec + k;
+
+        ds3231_test_sleep_until_raw(ktime_sub_ms(edge, DS3231_TEST_EDGE_MS));
+        KUNIT_ASSERT_TRUE(test, ds3231_cache_lookup(ds, &tm));
+        KUNIT_EXPECT_EQ(test, rtc_tm_to_time64(&tm), want - 1);
+
+        ds3231_test_sleep_until_raw(ktime_add_ms(edge, DS3231_TEST_EDGE_MS));
+        KUNIT_ASSERT_TRUE(test, ds3231_cache_lookup(ds, &tm));
+        KUNIT_EXPECT_EQ(test, rtc_tm_to_time64(&tm), want);
+
+        ds3231_test_read_regs(test, ds, regs);
+        KUNIT_ASSERT_EQ(test, ds3231_regs_to_date(regs, &tm), 0);
+        KUNIT_EXPECT_EQ(test, rtc_tm_to_time64(&tm), want);
+    }
+}
+
+
+/*
+ * Lesen der Zeitregister über das gewählte Transport-Backend.
+ */
+static void ds3231_test_bench_read_regs(struct kunit *test)
+{
+    struct ds3231_test_emu *emu = test->priv;
+    u8 regs[7];
+    ktime_t start;
+    u64 ns;
+    int i;
+
+    start = ktime_get();
+    for(i = 0; i < DS3231_BENCH_BUS_LOOPS; i++) {
+        ds3231_test_read_regs(test, emu->ds, regs);
+    }
+    ns = div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)), DS3231_BENCH_BUS_LOOPS);
+
+    kunit_info(test, "read_regs (%s): %llu ns/op\n", emu->ds->bus->name, ns);
+    KUNIT_EXPECT_LE(test, ns, (u64)DS3231_BENCH_READ_NS);
+}
+
+
+/*
+ * ds3231_read_date() wie von read() und RTC_RD_TIME, je nach cache_ms
+ * aus dem Cache oder vom Bus.
+ */
+static void ds3231_test_bench_read_date(struct kunit *test)
+{
+    struct ds3231_test_emu *emu = test->priv;
+    struct rtc_time tm;
+    ktime_t start;
+    u64 ns;
+    int i;
+
+    start = ktime_get();
+    for(i = 0; i < DS3231_BENCH_BUS_LOOPS; i++) {
+        KUNIT_ASSERT_EQ(test, ds3231_read_date(emu->ds, &tm), 0);
+    }
+    ns = div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)), DS3231_BENCH_BUS_LOOPS);
+
+    kunit_info(test, "read_date (cache_ms=%u): %llu ns/op\n", READ_ONCE(cache_ms), ns);
+    KUNIT_EXPECT_LE(test, ns, (u64)DS3231_BENCH_READ_NS);
+}
+
+
+/*
+ * ds3231_write_date() wie von write() und RTC_SET_TIME ohne Ausrichtung.
+ */
+static void ds3231_test_bench_write_date(struct kunit *test)
+{
+    struct ds3231_test_emu *emu = test->priv;
+    struct rtc_time tm = ds3231_test_tm(2024, 2, 29, 12, 34, 56);
+    ktime_t start;
+    u64 ns;
+    int i;
+
+    start = ktime_get();
+    for(i = 0; i < DS3231_BENCH_BUS_LOOPS; i++) {
+        KUNIT_ASSERT_EQ(test, ds3231_write_date(emu->ds, &tm), 0);
+    }
+    ns = div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)), DS3231_BENCH_BUS_LOOPS);
+
+    kunit_info(test, "write_date: %llu ns/op\n", ns);
+    KUNIT_EXPECT_LE(test, ns, (u64)DS3231_BENCH_WRITE_NS);
+}
+
+
+static struct kunit_case ds3231_emu_cases[] = {
+    KUNIT_CASE(ds3231_test_emu_roundtrip),
+    KUNIT_CASE(ds3231_test_emu_century),
+    KUNIT_CASE(ds3231_test_emu_12h),
+    KUNIT_CASE(ds3231_test_emu_phase_rollover),
+    KUNIT_CASE(ds3231_test_bench_read_regs),
+    KUNIT_CASE(ds3231_test_bench_read_date),
+    KUNIT_CASE(ds3231_test_bench_write_date),
+    {}
+};
+
+static struct kunit_suite ds3231_emu_suite = {
+    .name = "ds3231_emu",
+    .init = ds3231_test_emu_init,
+    .exit = ds3231_test_emu_exit,
+    .test_cases = ds3231_emu_cases,
+};
+
+/*
+ * Ab 5.7 registriert kunit_test_suites() alle Suiten einer Datei in einem
+ * Aufruf, ein zweiter würde dessen Symbole doppelt anlegen. 5.5 und 5.6
+ * kennen nur kunit_test_suite() mit einer Suite pro Aufruf.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+kunit_test_suites(&ds3231_codec_suite, &ds3231_emu_suite);
+#else
+kunit_test_suite(ds3231_codec_suite);
+kunit_test_suite(ds3231_emu_suite);
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Tracepoints des DS3231-Treibers.
+ *
+ * Ohne aktivierte Events kosten die Tracepoints nur einen statischen
+ * Sprung. Aktivieren z.B. mit
+ *   echo 1 > /sys/kernel/debug/tracing/events/ds3231/enable
+ *
+ * Der Header wird über TRACE_INCLUDE_PATH relativ zum Quellverzeichnis
+ * eingebunden, das Kbuild setzt dafür CFLAGS_ds3231.o := -I$(src).
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ds3231
+
+#if !defined(_DS3231_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DS3231_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+#ifndef DS3231_FOP_DEFINED
+#define DS3231_FOP_DEFINED
+/* Dateioperationen für ds3231_fop_enter/ds3231_fop_exit */
+enum ds3231_fop {
+    DS3231_FOP_OPEN,
+    DS3231_FOP_RELEASE,
+    DS3231_FOP_READ,
+    DS3231_FOP_WRITE,
+    DS3231_FOP_IOCTL,
+};
+#endif
+
+/* Namen der Enum-Werte für Userspace-Werkzeuge (perf, trace-cmd) auflösen */
+TRACE_DEFINE_ENUM(DS3231_FOP_OPEN);
+TRACE_DEFINE_ENUM(DS3231_FOP_RELEASE);
+TRACE_DEFINE_ENUM(DS3231_FOP_READ);
+TRACE_DEFINE_ENUM(DS3231_FOP_WRITE);
+TRACE_DEFINE_ENUM(DS3231_FOP_IOCTL);
+
+#define show_ds3231_fop(op)                          \
+    __print_symbolic(op,                             \
+        { DS3231_FOP_OPEN,    "open" },              \
+        { DS3231_FOP_RELEASE, "release" },           \
+        { DS3231_FOP_READ,    "read" },              \
+        { DS3231_FOP_WRITE,   "write" },             \
+        { DS3231_FOP_IOCTL,   "ioctl" })
+
+
+/*
+ * Beginn eines einzelnen Busversuchs (ohne Wiederholungen).
+ */
+TRACE_EVENT(ds3231_xfer_start,
+    TP_PROTO(u8 reg, u8 len, bool write),
+    TP_ARGS(reg, len, write),
+
+    TP_STRUCT__entry(
+        __field(u8,   reg)
+        __field(u8,   len)
+        __field(bool, write)
+    ),
+
+    TP_fast_assign(
+        __entry->reg   = reg;
+        __entry->len   = len;
+        __entry->write = write;
+    ),
+
+    TP_printk("%s reg=0x%02x len=%u",
+              __entry->write ? "write" : "read", __entry->reg, __entry->len)
+);
+
+
+/*
+ * Ende eines Busversuchs mit Ergebnis und Dauer.
+ */
+TRACE_EVENT(ds3231_xfer_end,
+    TP_PROTO(u8 reg, u8 len, bool write, int ret, s64 duration_ns),
+    TP_ARGS(reg, len, write, ret, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(u8,   reg)
+        __field(u8,   len)
+        __field(bool, write)
+        __field(int,  ret)
+        __field(s64,  duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->reg         = reg;
+        __entry->len         = len;
+        __entry->write       = write;
+        __entry->ret         = ret;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("%s reg=0x%02x len=%u ret=%d duration=%lld ns",
+              __entry->write ? "write" : "read", __entry->reg, __entry->len,
+              __entry->ret, __entry->duration_ns)
+);
+
+
+/*
+ * Wartezeit auf ds->lock.
+ */
+TRACE_EVENT(ds3231_lock_wait,
+    TP_PROTO(s64 wait_ns),
+    TP_ARGS(wait_ns),
+
+    TP_STRUCT__entry(
+        __field(s64, wait_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->wait_ns = wait_ns;
+    ),
+
+    TP_printk("wait=%lld ns", __entry->wait_ns)
+);
+
+
+/*
+ * Eintritt in eine Dateioperation von /dev/ds3231. cmd ist nur bei ioctl gesetzt.
+ */
+TRACE_EVENT(ds3231_fop_enter,
+    TP_PROTO(int op, unsigned int cmd),
+    TP_ARGS(op, cmd),
+
+    TP_STRUCT__entry(
+        __field(int,          op)
+        __field(unsigned int, cmd)
+    ),
+
+    TP_fast_assign(
+        __entry->op  = op;
+        __entry->cmd = cmd;
+    ),
+
+    TP_printk("%s cmd=0x%04x", show_ds3231_fop(__entry->op), __entry->cmd)
+);
+
+
+/*
+ * Austritt aus einer Dateioperation von /dev/ds3231.
+ */
+TRACE_EVENT(ds3231_fop_exit,
+    TP_PROTO(int op, long ret),
+    TP_ARGS(op, ret),
+
+    TP_STRUCT__entry(
+        __field(int,  op)
+        __field(long, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->op  = op;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s ret=%ld", show_ds3231_fop(__entry->op), __entry->ret)
+);
+
+#endif /* _DS3231_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ds3231_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,362 @@
+/*
+ * ds3231-bench - Lastgenerator und Latenzmessung für /dev/ds3231
+ *
+ * Öffnet /dev/ds3231 (und optional ein RTC-Class-Device wie /dev/rtc0)
+ * aus N Threads, treibt RTC_RD_TIME, read() und RTC_SET_TIME mit einer
+ * festen Rate pro Thread und gibt Durchsatz und Latenzen (p50/p99/p99.9)
+ * als JSON aus, eine Zeile pro Ziel und Operation.
+ *
+ * Übersetzen:
+ *   cc -O2 -Wall -pthread -o ds3231-bench ds3231-bench.c
+ *
+ * Beispiel:
+ *   ./ds3231-bench -t 32 -o rd_time,read -d 10
+ *   ./ds3231-bench -r /dev/rtc0 -t 4 -o rd_time -R 100
+ *
+ * RTC_SET_TIME schreibt die zuvor gelesene Zeit zurück. Der Treiber
+ * wartet dafür auf den nächsten Sekundenwechsel der Systemzeit, die
+ * Latenz liegt also bei bis zu einer Sekunde. Nur auf Testsystemen
+ * verwenden.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/rtc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define NSEC_PER_SEC    1000000000LL
+
+
+enum bench_op {
+    OP_RD_TIME,
+    OP_READ,
+    OP_SET_TIME,
+    OP_MAX
+};
+
+static const char *op_names[OP_MAX] = {
+    [OP_RD_TIME]  = "rd_time",
+    [OP_READ]     = "read",
+    [OP_SET_TIME] = "set_time",
+};
+
+
+/* Einstellungen aus der Kommandozeile */
+struct bench_cfg {
+    const char *dev;        /* Legacy-Device */
+    const char *rtc;        /* RTC-Class-Device oder NULL */
+    unsigned int threads;
+    unsigned int rate;      /* Operationen pro Sekunde und Thread, 0 = unbegrenzt */
+    unsigned int duration;  /* Sekunden pro Lauf */
+    int ops[OP_MAX];        /* Auszuführende Operationen */
+};
+
+
+/* Ergebnis eines Threads */
+struct bench_thread {
+    pthread_t tid;
+    const struct bench_cfg *cfg;
+    const char *path;
+    enum bench_op op;
+    int64_t *lat;           /* Latenzen in ns */
+    size_t n, cap;
+    uint64_t errors;
+    int open_errno;
+};
+
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+
+static int record(struct bench_thread *t, int64_t ns)
+{
+    int64_t *p;
+
+    if(t->n == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 4096;
+        p = realloc(t->lat, t->cap * sizeof(*t->lat));
+        if(p == NULL) {
+            return -1;
+        }
+        t->lat = p;
+    }
+    t->lat[t->n++] = ns;
+    return 0;
+}
+
+
+/*
+ * Eine Operation ausführen. Liefert 0 bei Erfolg.
+ */
+static int do_op(int fd, enum bench_op op)
+{
+    struct rtc_time tm;
+    char buf[64];
+
+    switch(op) {
+        case OP_RD_TIME:
+            return ioctl(fd, RTC_RD_TIME, &tm) < 0 ? -1 : 0;
+
+        case OP_READ:
+            /* /dev/ds3231 liefert eine Zeile und danach EOF */
+            if(read(fd, buf, sizeof(buf)) <= 0) {
+                return -1;
+            }
+            return read(fd, buf, sizeof(buf)) < 0 ? -1 : 0;
+
+        case OP_SET_TIME:
+            if(ioctl(fd, RTC_RD_TIME, &tm) < 0) {
+                return -1;
+            }
+            return ioctl(fd, RTC_SET_TIME, &tm) < 0 ? -1 : 0;
+
+        default:
+            return -1;
+    }
+}
+
+
+static void *bench_thread_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    const struct bench_cfg *cfg = t->cfg;
+    int64_t period = cfg->rate ? NSEC_PER_SEC / cfg->rate : 0;
+    int64_t end, next, start;
+    struct timespec ts;
+    int fd;
+
+    fd = open(t->path, O_RDONLY);
+    if(fd < 0) {
+        t->open_errno = errno;
+        return NULL;
+    }
+
+    next = now_ns();
+    end = next + (int64_t)cfg->duration * NSEC_PER_SEC;
+
+    while(next < end) {
+        if(period) {
+            ts.tv_sec = next / NSEC_PER_SEC;
+            ts.tv_nsec = next % NSEC_PER_SEC;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        start = now_ns();
+        if(do_op(fd, t->op) != 0) {
+            t->errors++;
+        }
+        else if(record(t, now_ns() - start) != 0) {
+            break;
+        }
+
+        next = period ? next + period : now_ns();
+    }
+
+    close(fd);
+    return NULL;
+}
+
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static int64_t percentile(const int64_t *v, size_t n, double p)
+{
+    size_t idx;
+
+    if(n == 0) {
+        return 0;
+    }
+    idx = (size_t)(p / 100.0 * (double)(n - 1) + 0.5);
+    return v[idx];
+}
+
+
+/*
+ * Einen Lauf (Ziel, Operation) mit allen Threads durchführen und als
+ * JSON-Zeile ausgeben.
+ */
+static int run(const struct bench_cfg *cfg, const char *path, enum bench_op op)
+{
+    struct bench_thread *th;
+    int64_t *all;
+    size_t total = 0, pos = 0;
+    uint64_t errors = 0;
+    int64_t t0, elapsed;
+    unsigned int i;
+    int open_errno = 0;
+
+    th = calloc(cfg->threads, sizeof(*th));
+    if(th == NULL) {
+        return -1;
+    }
+
+    t0 = now_ns();
+    for(i = 0; i < cfg->threads; i++) {
+        th[i].cfg = cfg;
+        th[i].path = path;
+        th[i].op = op;
+        if(pthread_create(&th[i].tid, NULL, bench_thread_fn, &th[i]) != 0) {
+            fprintf(stderr, "ds3231-bench: pthread_create fehlgeschlagen\n");
+            exit(1);
+        }
+    }
+    for(i = 0; i < cfg->threads; i++) {
+        pthread_join(th[i].tid, NULL);
+        total += th[i].n;
+        errors += th[i].errors;
+        if(th[i].open_errno) {
+            open_errno = th[i].open_errno;
+        }
+    }
+    elapsed = now_ns() - t0;
+
+    if(open_errno) {
+        fprintf(stderr, "ds3231-bench: %s: %s\n", path, strerror(open_errno));
+    }
+
+    all = malloc((total ? total : 1) * sizeof(*all));
+    if(all == NULL) {
+        return -1;
+    }
+    for(i = 0; i < cfg->threads; i++) {
+        if(th[i].n) {
+            memcpy(all + pos, th[i].lat, th[i].n * sizeof(*all));
+        }
+        pos += th[i].n;
+        free(th[i].lat);
+    }
+    qsort(all, total, sizeof(*all), cmp_i64);
+
+    printf("{\"target\":\"%s\",\"op\":\"%s\",\"threads\":%u,\"rate_per_thread\":%u,"
+           "\"duration_ns\":%lld,\"ops\":%zu,\"errors\":%llu,\"throughput_ops_s\":%.1f,"
+           "\"latency_ns\":{\"min\":%lld,\"p50\":%lld,\"p99\":%lld,\"p99_9\":%lld,\"max\":%lld}}\n",
+           path, op_names[op], cfg->threads, cfg->rate,
+           (long long)elapsed, total, (unsigned long long)errors,
+           elapsed ? (double)total * NSEC_PER_SEC / (double)elapsed : 0.0,
+           (long long)(total ? all[0] : 0),
+           (long long)percentile(all, total, 50.0),
+           (long long)percentile(all, total, 99.0),
+           (long long)percentile(all, total, 99.9),
+           (long long)(total ? all[total - 1] : 0));
+    fflush(stdout);
+
+    free(all);
+    free(th);
+    return 0;
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Aufruf: ds3231-bench [Optionen]\n"
+            "  -D <pfad>   Legacy-Device (Standard: /dev/ds3231, \"-\" = keins)\n"
+            "  -r <pfad>   Zusätzlich ein RTC-Class-Device, z.B. /dev/rtc0\n"
+            "  -t <n>      Anzahl Threads (Standard: 1)\n"
+            "  -R <n>      Operationen pro Sekunde und Thread (Standard: 0 = unbegrenzt)\n"
+            "  -d <s>      Dauer pro Lauf in Sekunden (Standard: 5)\n"
+            "  -o <liste>  Operationen, kommagetrennt: rd_time,read,set_time\n"
+            "              (Standard: rd_time)\n");
+    exit(2);
+}
+
+
+static void parse_ops(struct bench_cfg *cfg, char *list)
+{
+    char *tok, *save = NULL;
+    int i, found;
+
+    memset(cfg->ops, 0, sizeof(cfg->ops));
+    for(tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        found = 0;
+        for(i = 0; i < OP_MAX; i++) {
+            if(strcmp(tok, op_names[i]) == 0) {
+                cfg->ops[i] = 1;
+                found = 1;
+            }
+        }
+        if(!found) {
+            fprintf(stderr, "ds3231-bench: unbekannte Operation \"%s\"\n", tok);
+            usage();
+        }
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    struct bench_cfg cfg = {
+        .dev      = "/dev/ds3231",
+        .rtc      = NULL,
+        .threads  = 1,
+        .rate     = 0,
+        .duration = 5,
+        .ops      = { [OP_RD_TIME] = 1 },
+    };
+    int c, i;
+
+    while((c = getopt(argc, argv, "D:r:t:R:d:o:h")) != -1) {
+        switch(c) {
+            case 'D':
+                cfg.dev = strcmp(optarg, "-") == 0 ? NULL : optarg;
+                break;
+            case 'r':
+                cfg.rtc = optarg;
+                break;
+            case 't':
+                cfg.threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'R':
+                cfg.rate = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                cfg.duration = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                parse_ops(&cfg, optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if(cfg.threads == 0 || cfg.duration == 0) {
+        usage();
+    }
+
+    for(i = 0; i < OP_MAX; i++) {
+        if(!cfg.ops[i]) {
+            continue;
+        }
+        if(cfg.dev) {
+            run(&cfg, cfg.dev, i);
+        }
+        /* read() auf /dev/rtcN wartet auf Interrupts, dort nicht messen */
+        if(cfg.rtc && i != OP_READ && access(cfg.rtc, R_OK) == 0) {
+            run(&cfg, cfg.rtc, i);
+        }
+    }
+
+    return 0;
+}